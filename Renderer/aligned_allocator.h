@@ -0,0 +1,60 @@
+#pragma once
+#include <cstddef>
+#include <new>
+
+#ifdef _WIN32
+#include <malloc.h>
+#else
+#include <stdlib.h>
+#endif
+
+namespace end
+{
+	// aligned_allocator_t
+	//
+	// std::allocator replacement that puts every block on an 'Alignment' byte boundary.
+	// Without C++17 aligned new, std::vector only guarantees 8 or 16 bytes, whatever alignas says.
+	template<typename T, size_t Alignment>
+	struct aligned_allocator_t
+	{
+		using value_type = T;
+
+		template<typename U>
+		struct rebind { using other = aligned_allocator_t<U, Alignment>; };
+
+		aligned_allocator_t() = default;
+
+		template<typename U>
+		aligned_allocator_t(const aligned_allocator_t<U, Alignment>&) {}
+
+		T* allocate(size_t count)
+		{
+#ifdef _WIN32
+			void* block = _aligned_malloc(count * sizeof(T), Alignment);
+#else
+			void* block = nullptr;
+			if (posix_memalign(&block, Alignment, count * sizeof(T)) != 0)
+				block = nullptr;
+#endif
+			if (!block)
+				throw std::bad_alloc();
+
+			return (T*)block;
+		}
+
+		void deallocate(T* block, size_t)
+		{
+#ifdef _WIN32
+			_aligned_free(block);
+#else
+			free(block);
+#endif
+		}
+
+		template<typename U>
+		bool operator==(const aligned_allocator_t<U, Alignment>&)const { return true; }
+
+		template<typename U>
+		bool operator!=(const aligned_allocator_t<U, Alignment>&)const { return false; }
+	};
+}
\ No newline at end of file
@@ -1,10 +1,12 @@
 #include "bvh.h"
 #include "debug_renderer.h"
 #include <random>
+#include <algorithm>
+#include <ostream>
 
 namespace end
 {
-	const aabb_t encapsulate(const aabb_t& first, const aabb_t& second)
+	aabb_t encapsulate(const aabb_t& first, const aabb_t& second)
 	{
 		float3 first_max = first.center + first.extents;
 		float3 first_min = first.center - first.extents;
@@ -29,6 +31,14 @@ namespace end
 		return { new_center, new_extents };
 	}
 
+	float surface_area(const aabb_t& aabb)
+	{
+		const float3& e = aabb.extents;
+
+		// Extents are half-sizes, so each face is (2a * 2b)
+		return 8.0f * (e.x * e.y + e.y * e.z + e.z * e.x);
+	}
+
 	bvh_node_t::bvh_node_t(bvh_node_t* root, uint32_t left_index, uint32_t right_index)
 	{
 		//TODO The root pointer is the array of the entire bvh
@@ -48,44 +58,133 @@ namespace end
 		return abs(cost.x) + abs(cost.y) + abs(cost.z);
 	}
 
-	bool aabbs_collide(aabb_t first, aabb_t second)
+	void bounding_volume_hierarchy_t::traverse_tree(uint32_t index, const aabb_t& target, std::vector<int>& quads_to_draw, const end::grid_colors& colors, bvh_query_stats_t* stats)const
 	{
-		float3 first_max = first.center + first.extents;
-		float3 first_min = first.center - first.extents;
-		float3 second_max = second.center + second.extents;
-		float3 second_min = second.center - second.extents;
+		bvh_stack_t<uint32_t> stack;
+
+		// Counted locally and added to 'stats' once at the end
+		bvh_query_stats_t counts;
+
+		while (true)
+		{
+			const bvh_node_t& node = bvh[index];
+			counts.aabb_tests++;
+
+			if (aabbs_collide(node.aabb(), target))
+			{
+				counts.nodes_visited++;
+
+#if BVH_DEBUG_DRAW
+				debug_renderer::draw_aabb(node.aabb(), colors.horizontal_end);
+#endif
+
+				if (node.is_branch())
+				{
+					// Visit the left side first, come back for the right one
+					stack.push(node.right());
+					index = node.left();
+					continue;
+				}
+
+				// add quad to quad_to_draw
+				quads_to_draw.push_back(node.element_id());
+				counts.leaves_emitted++;
+			}
 
-		// In order for a point to intersect, the max/min must intersect
-		return  first_min.x < second_max.x && first_max.x > second_min.x 
-			&&
-				first_min.y < second_max.y && first_max.y > second_min.y 
-			&&
-				first_min.z < second_max.z && first_max.z > second_min.z;
+			if (stack.empty())
+				break;
+
+			index = stack.pop();
+		}
+
+		if (stats)
+		{
+			stats->nodes_visited += counts.nodes_visited;
+			stats->aabb_tests += counts.aabb_tests;
+			stats->leaves_emitted += counts.leaves_emitted;
+		}
 	}
 
-	void bounding_volume_hierarchy_t::traverse_tree(uint32_t index, aabb_t target, std::vector<int>& quads_to_draw, end::grid_colors colors)
+	bvh_stats_t bounding_volume_hierarchy_t::compute_stats()const
 	{
-		float4 node_color = colors.horizontal_end;
-		bvh_node_t node = bvh[index];
+		bvh_stats_t stats;
+		stats.node_count = node_count();
 
-		if (aabbs_collide(node.aabb(), target))
+		if (bvh.empty())
+			return stats;
+
+		// Pending nodes, along with their depth
+		struct pending_t
 		{
-			debug_renderer::draw_aabb(node.aabb(), node_color);
+			uint32_t index;
+			uint32_t depth;
+		};
+
+		std::vector<pending_t> stack;
+		stack.push_back({ 0, 0 });
+
+		float branch_area = 0.0f;
+		float leaf_area = 0.0f;
+		uint64_t depth_sum = 0;
+
+		while (!stack.empty())
+		{
+			pending_t pending = stack.back();
+			stack.pop_back();
+
+			const bvh_node_t& node = bvh[pending.index];
 
 			if (node.is_leaf())
 			{
-				// add quad to quad_to_draw
-				quads_to_draw.push_back(node.element_id());
-
-				return;
+				stats.leaf_count++;
+				stats.max_leaf_depth = std::max(stats.max_leaf_depth, pending.depth);
+				depth_sum += pending.depth;
+				leaf_area += surface_area(node.aabb());
+				continue;
 			}
-			else
+
+			branch_area += surface_area(node.aabb());
+
+			// Volume of the intersection of the two children
+			const aabb_t& left = bvh[node.left()].aabb();
+			const aabb_t& right = bvh[node.right()].aabb();
+			float overlap = 1.0f;
+			for (int i = 0; i < 3; i++)
 			{
-				// find which path to traverse
-				traverse_tree(node.left(), target, quads_to_draw, colors);
-				traverse_tree(node.right(), target, quads_to_draw, colors);
+				float low = std::max(left.center[i] - left.extents[i], right.center[i] - right.extents[i]);
+				float high = std::min(left.center[i] + left.extents[i], right.center[i] + right.extents[i]);
+				overlap *= std::max(0.0f, high - low);
 			}
+			stats.sibling_overlap += overlap;
+
+			stack.push_back({ node.right(), pending.depth + 1 });
+			stack.push_back({ node.left(), pending.depth + 1 });
 		}
+
+		stats.average_leaf_depth = (float)depth_sum / (float)stats.leaf_count;
+
+		// A flat or empty root box would divide by zero, count every node as visited instead
+		float root_area = surface_area(bvh[0].aabb());
+		if (root_area > 0.0f)
+			stats.sah_cost = (branch_area + leaf_area) / root_area;
+		else
+			stats.sah_cost = (float)stats.node_count;
+
+		return stats;
+	}
+
+	void print_bvh_stats(std::ostream& out, const bvh_stats_t& stats)
+	{
+		out << "BVH: " << stats.node_count << " nodes, " << stats.leaf_count << " leaves"
+			<< ", SAH cost " << stats.sah_cost
+			<< ", leaf depth max " << stats.max_leaf_depth << " avg " << stats.average_leaf_depth
+			<< ", sibling overlap " << stats.sibling_overlap << "\n";
+	}
+
+	void print_bvh_stats(std::ostream& out, const bvh_query_stats_t& stats)
+	{
+		out << "BVH query: " << stats.nodes_visited << " nodes visited, " << stats.aabb_tests << " aabb tests"
+			<< ", " << stats.leaves_emitted << " leaves emitted\n";
 	}
 
 	void bounding_volume_hierarchy_t::insert(const aabb_t& aabb, uint32_t element_id)
@@ -93,13 +192,13 @@ namespace end
 		//TODO
 		//create a bvh node using the passed in parameters(do not call new)
 		bvh_node_t new_node(aabb, element_id);
-		new_node.left() = 0;
 
 		//TODO
 		//if its the first node, it becomes the root. So just push it into bvh vector, then return
 		if (bvh.size() == 0)
 		{
 			bvh.push_back(new_node);
+			update_element_leaves();
 			return;
 		}
 
@@ -137,12 +236,76 @@ namespace end
 		//set the parents of these two nodes
 		//uint32_t parent_index = current_node.parent();
 		bvh_node_t new_leaf(bvh[current_node_index]);
+		uint32_t parent_index = new_leaf.is_root() ? UINT32_MAX : new_leaf.parent();
 		new_leaf.set_parent(current_node_index);
 		new_node.set_parent(current_node_index);
 		bvh.push_back(new_leaf);
 		bvh.push_back(new_node);
 
 		bvh[current_node_index] = bvh_node_t(bvh.data(), bvh.size() - 2, bvh.size() - 1);
+		bvh[current_node_index].set_parent(parent_index);
+
+		// The old leaf moved, and the new one needs an entry
+		uint32_t max_id = std::max(new_leaf.element_id(), element_id);
+		if (element_leaves.size() <= max_id)
+			element_leaves.resize(max_id + 1, UINT32_MAX);
+		element_leaves[new_leaf.element_id()] = (uint32_t)bvh.size() - 2;
+		element_leaves[element_id] = (uint32_t)bvh.size() - 1;
+	}
+
+	void bounding_volume_hierarchy_t::refit(uint32_t element_id, const aabb_t& aabb)
+	{
+		assert(element_id < element_leaves.size() && element_leaves[element_id] != UINT32_MAX);
+
+		uint32_t index = element_leaves[element_id];
+		bvh[index].aabb() = aabb;
+
+		while (!bvh[index].is_root())
+		{
+			index = bvh[index].parent();
+			bvh_node_t& node = bvh[index];
+
+			aabb_t refit_aabb = encapsulate(bvh[node.left()].aabb(), bvh[node.right()].aabb());
+			const aabb_t& old_aabb = node.aabb();
+
+			// Nothing above this node can change either
+			if (refit_aabb.center.x == old_aabb.center.x && refit_aabb.extents.x == old_aabb.extents.x &&
+				refit_aabb.center.y == old_aabb.center.y && refit_aabb.extents.y == old_aabb.extents.y &&
+				refit_aabb.center.z == old_aabb.center.z && refit_aabb.extents.z == old_aabb.extents.z)
+				return;
+
+			node.aabb() = refit_aabb;
+		}
+	}
+
+	void bounding_volume_hierarchy_t::refit_all(const aabb_t* element_aabbs)
+	{
+		for (size_t i = bvh.size(); i-- > 0;)
+		{
+			bvh_node_t& node = bvh[i];
+
+			if (node.is_leaf())
+				node.aabb() = element_aabbs[node.element_id()];
+			else
+				node.aabb() = encapsulate(bvh[node.left()].aabb(), bvh[node.right()].aabb());
+		}
+	}
+
+	void bounding_volume_hierarchy_t::update_element_leaves()
+	{
+		element_leaves.clear();
+
+		for (uint32_t i = 0; i < bvh.size(); i++)
+		{
+			if (bvh[i].is_branch())
+				continue;
+
+			uint32_t element_id = bvh[i].element_id();
+			if (element_leaves.size() <= element_id)
+				element_leaves.resize(element_id + 1, UINT32_MAX);
+
+			element_leaves[element_id] = i;
+		}
 	}
 
 
@@ -1,10 +1,24 @@
 #pragma once
 #include <cstdint>
 #include <cassert>
+#include <cmath>
 
 #include <vector>
+#include <utility>
+#include <iosfwd>
 
 #include "math_types.h"
+#include "frustum_culling.h"
+
+// Draw the nodes visited by bvh_t::traverse_tree with the debug renderer.
+// Compiled out of release builds unless defined by the project.
+#ifndef BVH_DEBUG_DRAW
+#ifdef NDEBUG
+#define BVH_DEBUG_DRAW 0
+#else
+#define BVH_DEBUG_DRAW 1
+#endif
+#endif
 
 //aabb_t{ float3 min; float3 max; };
 
@@ -20,7 +34,7 @@ namespace end
 		// TODO: This constructor is the only function for you to implement in this file.
 		bvh_node_t(bvh_node_t* root, uint32_t left_index, uint32_t right_index);
 
-		bvh_node_t(const aabb_t& bounds, uint32_t id) : _aabb{ bounds }, _id{ id } {}
+		bvh_node_t(const aabb_t& bounds, uint32_t id) : _left{ 0 }, _id{ id }, _aabb{ bounds } {}
 
 		bvh_node_t() = default;
 		bvh_node_t(const bvh_node_t&) = default;
@@ -116,26 +130,381 @@ namespace end
 		aabb_t _aabb;
 	};
 
+	// Returns true if the two aabbs overlap
+	inline bool aabbs_collide(const aabb_t& first, const aabb_t& second)
+	{
+		float3 first_max = first.center + first.extents;
+		float3 first_min = first.center - first.extents;
+		float3 second_max = second.center + second.extents;
+		float3 second_min = second.center - second.extents;
+
+		// In order for a point to intersect, the max/min must intersect
+		return  first_min.x < second_max.x && first_max.x > second_min.x 
+			&&
+				first_min.y < second_max.y && first_max.y > second_min.y 
+			&&
+				first_min.z < second_max.z && first_max.z > second_min.z;
+	}
+
+	// Returns true if 'inner' is entirely inside 'outer'
+	inline bool aabb_contains(const aabb_t& outer, const aabb_t& inner)
+	{
+		float3 outer_max = outer.center + outer.extents;
+		float3 outer_min = outer.center - outer.extents;
+		float3 inner_max = inner.center + inner.extents;
+		float3 inner_min = inner.center - inner.extents;
+
+		return outer_min.x <= inner_min.x && outer_max.x >= inner_max.x
+			&& outer_min.y <= inner_min.y && outer_max.y >= inner_max.y
+			&& outer_min.z <= inner_min.z && outer_max.z >= inner_max.z;
+	}
+
+	// Returns an aabb that encapsulates both aabbs
+	aabb_t encapsulate(const aabb_t& first, const aabb_t& second);
+
+	// Returns the surface area of an aabb
+	float surface_area(const aabb_t& aabb);
+
+	// Pending nodes the non-recursive traversals keep without touching the heap.
+	// Trees from build(), build_parallel() and build_lbvh() stay far below this depth.
+	constexpr uint32_t BVH_STACK_SIZE = 256;
+
+	// bvh_stack_t
+	//
+	// Stack of pending nodes for the non-recursive traversals.
+	// The first BVH_STACK_SIZE entries live inline, the rest spill into a vector,
+	// so trees deeper than the builders make (from insert(), edits or loaded files) still work.
+	template<typename T>
+	class bvh_stack_t
+	{
+	public:
+		inline bool empty()const { return count == 0; }
+
+		inline void push(const T& value)
+		{
+			if (count < BVH_STACK_SIZE)
+				items[count] = value;
+			else
+				overflow.push_back(value);
+			count++;
+		}
+
+		inline T pop()
+		{
+			assert(count > 0);
+			count--;
+			if (count < BVH_STACK_SIZE)
+				return items[count];
+
+			T value = overflow.back();
+			overflow.pop_back();
+			return value;
+		}
+
+	private:
+		T items[BVH_STACK_SIZE];
+		std::vector<T> overflow;
+		uint32_t count = 0;
+	};
+
+	// Most leaves a treelet can have in bvh_t::optimize_treelets.
+	// Each treelet is solved over every subset of its leaves, so this must stay small.
+	constexpr uint32_t BVH_TREELET_SIZE = 7;
+
+	// Interleaves the low 10 bits of x, y and z into a 30-bit Morton (Z-order) code
+	uint32_t morton_code_30(uint32_t x, uint32_t y, uint32_t z);
+
+	// Interleaves the low 21 bits of x, y and z into a 63-bit Morton (Z-order) code
+	uint64_t morton_code_63(uint32_t x, uint32_t y, uint32_t z);
+
+	// Quality metrics of a whole tree, from bvh_t::compute_stats
+	struct bvh_stats_t
+	{
+		size_t node_count = 0;
+		size_t leaf_count = 0;
+
+		// Surface area heuristic cost of the tree, relative to the root's surface area.
+		// Visiting a branch and testing a leaf both cost 1, so lower is better.
+		float sah_cost = 0.0f;
+
+		// Depth of the leaves, the root is at depth 0
+		uint32_t max_leaf_depth = 0;
+		float average_leaf_depth = 0.0f;
+
+		// Sum of the volumes shared by the two children of each branch
+		float sibling_overlap = 0.0f;
+	};
+
+	// Work done by a single traversal, from bvh_t::traverse_tree
+	struct bvh_query_stats_t
+	{
+		// Nodes whose box collided with the target
+		uint32_t nodes_visited = 0;
+
+		// Node boxes tested against the target
+		uint32_t aabb_tests = 0;
+
+		// Element ids added to the output
+		uint32_t leaves_emitted = 0;
+	};
+
+	// Writes the stats as a single readable line
+	void print_bvh_stats(std::ostream& out, const bvh_stats_t& stats);
+	void print_bvh_stats(std::ostream& out, const bvh_query_stats_t& stats);
+
+	// Closest hit found by bvh_t::raycast and bvh_t::segment_cast
+	struct bvh_ray_hit_t
+	{
+		// Element id of the quad that was hit, UINT32_MAX if nothing was hit
+		uint32_t element_id = UINT32_MAX;
+
+		// 0 for quad_t::first, 1 for quad_t::second
+		uint32_t triangle = 0;
+
+		// Barycentric weights of the triangle's b and c vertices at the hit point
+		float u = 0.0f;
+		float v = 0.0f;
+
+		// Distance along the ray, in multiples of its direction
+		float t = 0.0f;
+
+		inline bool hit()const { return element_id != UINT32_MAX; }
+	};
+
+	// Closest point found by bvh_t::closest_point
+	struct bvh_closest_point_t
+	{
+		// Element id of the closest quad, UINT32_MAX if none was in range
+		uint32_t element_id = UINT32_MAX;
+
+		// Closest point on that quad's triangles
+		float3 point = { 0.0f, 0.0f, 0.0f };
+
+		float distance_squared = INFINITY;
+
+		inline bool found()const { return element_id != UINT32_MAX; }
+	};
+
+	// Number of queries bvh_t::query_batch traverses the tree with at once
+	constexpr uint32_t BVH_PACKET_SIZE = 64;
+
+	// Results of bvh_t::query_batch, stored back to back in one buffer
+	struct bvh_batch_result_t
+	{
+		// Results of query i are element_ids[offsets[i]] up to element_ids[offsets[i + 1]]
+		std::vector<uint32_t> offsets;
+		std::vector<uint32_t> element_ids;
+
+		inline uint32_t count(uint32_t query)const { return offsets[query + 1] - offsets[query]; }
+
+		inline const uint32_t* begin(uint32_t query)const { return element_ids.data() + offsets[query]; }
+
+		inline const uint32_t* end(uint32_t query)const { return element_ids.data() + offsets[query + 1]; }
+	};
+
 	struct bounding_volume_hierarchy_t
 	{
 		std::vector<bvh_node_t> bvh;
 
+		// Leaf node index of each element id, UINT32_MAX for ids that aren't in the tree.
+		// Kept up to date by insert() and the builders.
+		std::vector<uint32_t> element_leaves;
+
 		inline bvh_node_t& node_at(uint32_t i) { return bvh[i]; }
 
 		inline size_t node_count()const { return bvh.size(); }
 
 		static float cost(const bvh_node_t& a, const bvh_node_t& b);
 
-		//TODO
-		//You will need to create a traversal function to render the aabb's as they collide on the way down
-		//You could create a callback function as well and that function does the collision tests and drawws the aabb lines
-		//a recursive depth-first function could work
-		void traverse_tree(uint32_t index, aabb_t target, std::vector<int>& quads_to_draw, end::grid_colors colors);
+		// Adds the element id of every leaf under 'index' that collides with 'target' to quads_to_draw.
+		// When BVH_DEBUG_DRAW is on, every colliding node is also drawn with the debug renderer.
+		// If 'stats' isn't null, the work done is added to it.
+		void traverse_tree(uint32_t index, const aabb_t& target, std::vector<int>& quads_to_draw, const end::grid_colors& colors, bvh_query_stats_t* stats = nullptr)const;
+
+		// Measures the quality of the tree. Walks every node, so it's meant for tools and logging.
+		bvh_stats_t compute_stats()const;
+
+		// Calls visitor(element_id) for every leaf that collides with 'target'.
+		//
+		// Non-recursive and allocation-free, pending nodes are kept in a fixed-size stack.
+		// The visitor returns false to stop the query early.
+		// Returns false if the query was stopped by the visitor.
+		template<typename Visitor>
+		bool query(const aabb_t& target, Visitor&& visitor)const;
+
+		// Finds the closest triangle hit by the ray origin + direction * t, for t in [0, t_max].
+		//
+		// Element ids must index into 'quads', whose triangles index into 'verts'.
+		// Nodes are slab tested with a precomputed inverse direction and visited front-to-back,
+		// skipping any node that starts beyond the closest hit so far.
+		// Triangles are two-sided and tested with Moller-Trumbore.
+		// Returns true and fills 'hit' if anything was hit.
+		bool raycast(const float3& origin, const float3& direction, float t_max, const quad_t* quads, const pos_norm_uv_vertex* verts, bvh_ray_hit_t& hit)const;
+
+		// Same as raycast(), for the segment from segment_start to segment_end.
+		// hit.t is the fraction of the way along the segment, in [0, 1].
+		bool segment_cast(const float3& segment_start, const float3& segment_end, const quad_t* quads, const pos_norm_uv_vertex* verts, bvh_ray_hit_t& hit)const;
+
+		// Appends the element id of every leaf whose aabb isn't outside 'frustum' to 'out'.
+		//
+		// Each node carries a mask of the planes it still has to be tested against.
+		// Planes a node is fully inside are dropped from the mask of its subtree, and once
+		// the mask is empty the whole subtree is emitted without further tests.
+		void query_frustum(const frustum_t& frustum, std::vector<int>& out)const;
+
+		// Finds the closest point to 'point' on the triangles of any quad within 'max_distance'.
+		//
+		// Element ids must index into 'quads', whose triangles index into 'verts'.
+		// Nodes are visited best-first by their distance to 'point', and the search
+		// stops once the nearest pending node is further away than the closest point so far.
+		// Returns true and fills 'result' if a quad was in range.
+		bool closest_point(const float3& point, const quad_t* quads, const pos_norm_uv_vertex* verts, bvh_closest_point_t& result, float max_distance = INFINITY)const;
+
+		// Replaces 'element_ids' with the (up to) k elements whose aabbs are nearest to 'point',
+		// nearest first. Aabbs containing 'point' are at distance 0.
+		void k_nearest(const float3& point, uint32_t k, std::vector<uint32_t>& element_ids)const;
+
+		// Runs query() for 'count' targets at once and stores every result in 'results'.
+		//
+		// Targets are grouped into packets of BVH_PACKET_SIZE, and each packet walks the tree once.
+		// Every pending node carries a bit mask of the targets that reached it, so a node is
+		// fetched once per packet, and the targets are tested against it four at a time with SSE.
+		// Element ids of each target are in the same order query() would visit them.
+		void query_batch(const aabb_t* targets, uint32_t count, bvh_batch_result_t& results)const;
 
 		// Add an aabb/element_id pair to the bvh
 		void insert(const aabb_t& aabb, uint32_t element_id);
+
+		// Moves an element to 'aabb' and refits the branches above it.
+		// Walks up the parent links, and stops as soon as a branch's box doesn't change.
+		void refit(uint32_t element_id, const aabb_t& aabb);
+
+		// Moves every element to element_aabbs[element_id] and refits the whole tree.
+		// Children are always stored after their parent, so a single backwards
+		// sweep over the nodes updates the tree bottom-up.
+		void refit_all(const aabb_t* element_aabbs);
+
+		// Rebuilds element_leaves from the leaves in bvh
+		void update_element_leaves();
+
+		// Replaces the bvh with a tree built top-down from 'count' aabb/element_id pairs.
+		//
+		// Each split is chosen with a binned surface area heuristic (SAH).
+		// Nodes are stored depth-first, so a branch's left child is always the next node.
+		void build(const aabb_t* aabbs, const uint32_t* element_ids, uint32_t count);
+
+		// Same as build(), but splits the work across 'thread_count' threads (0 = one per core).
+		//
+		// The top splits are made breadth-first, then whole subtrees are built in parallel.
+		// Every subtree is written to a node range fixed by its element count, so the
+		// result is identical to build() no matter how the threads are scheduled.
+		void build_parallel(const aabb_t* aabbs, const uint32_t* element_ids, uint32_t count, uint32_t thread_count = 0);
+
+		// Replaces the bvh with a linear bvh (LBVH), meant for rebuilding every frame.
+		//
+		// Element centers are given Morton codes on a grid over their bounds and radix sorted,
+		// then the tree is written in a single depth-first pass, splitting each range at its
+		// highest differing code bit. Quality is lower than build(), but it's much faster.
+		// 30-bit codes are enough for most scenes, 63-bit codes help with large, dense ones.
+		void build_lbvh(const aabb_t* aabbs, const uint32_t* element_ids, uint32_t count, bool use_63bit_codes = false);
+
+		// Improves an existing tree in place by rearranging small treelets, for trees that were
+		// built with insert() or build_lbvh() and can't be rebuilt (Karras and Aila, TRBVH).
+		//
+		// Every branch roots a treelet, grown by opening its largest descendant until it has
+		// BVH_TREELET_SIZE leaves. Each treelet is given the topology with the lowest SAH cost
+		// by dynamic programming over the subsets of its leaves.
+		// Treelets at the same depth don't overlap, so each depth is optimized in parallel
+		// across 'thread_count' threads (0 = one per core), going from the deepest up.
+		// Afterwards the nodes are stored depth-first again, so element_leaves is rebuilt.
+		void optimize_treelets(uint32_t iterations = 3, uint32_t thread_count = 0);
 	};
 
 	// Declares a short-hand alias
 	using bvh_t = bounding_volume_hierarchy_t;
+
+	// bvh_query_cache_t
+	//
+	// Remembers where the last query started, for targets that move a little every frame.
+	//
+	// Each query starts from the last start node, climbing parent links while the target
+	// misses it, then going down while one child fully contains the target or is the only
+	// one it collides with. Boxes of other subtrees can still reach the target, so the
+	// siblings of the nodes above the start are tested too, one box test per level, and
+	// the next query starts above any that collided.
+	// Results are the same elements as bvh_t::traverse_tree from the root, in a different order.
+	class bvh_query_cache_t
+	{
+	public:
+		// Adds the element id of every leaf of 'tree' that collides with 'target' to quads_to_draw.
+		// Debug drawing and 'stats' work as in bvh_t::traverse_tree.
+		void traverse_tree(const bvh_t& tree, const aabb_t& target, std::vector<int>& quads_to_draw, const end::grid_colors& colors, bvh_query_stats_t* stats = nullptr);
+
+		// Starts the next query from the root again
+		inline void reset() { start = 0; }
+
+		inline uint32_t start_node()const { return start; }
+
+	private:
+		uint32_t start = 0;
+	};
+
+	// Pair of overlapping elements found by find_overlapping_pairs
+	struct bvh_pair_t
+	{
+		uint32_t first;
+		uint32_t second;
+	};
+
+	// Replaces 'pairs' with every (element of a, element of b) pair whose aabbs collide.
+	//
+	// Both trees are descended together, always opening the node with the larger surface area,
+	// and subtrees whose boxes don't collide are skipped as a whole.
+	// 'pairs' is only cleared, so reusing it between frames avoids allocations.
+	void find_overlapping_pairs(const bvh_t& a, const bvh_t& b, std::vector<bvh_pair_t>& pairs);
+
+	// Replaces 'pairs' with every pair of elements in 'tree' whose aabbs collide.
+	// Each pair is reported once, with first < second.
+	void find_overlapping_pairs(const bvh_t& tree, std::vector<bvh_pair_t>& pairs);
+
+	// Calls visitor(element_id) for every leaf in 'nodes' that collides with 'target'.
+	// Works on any node array with the root at [0], such as a bvh file mapped in place.
+	template<typename Visitor>
+	bool query_nodes(const bvh_node_t* nodes, size_t node_count, const aabb_t& target, Visitor&& visitor)
+	{
+		if (node_count == 0)
+			return true;
+
+		bvh_stack_t<uint32_t> stack;
+		uint32_t index = 0;
+
+		while (true)
+		{
+			const bvh_node_t& node = nodes[index];
+
+			if (aabbs_collide(node.aabb(), target))
+			{
+				if (node.is_branch())
+				{
+					stack.push(node.right());
+					index = node.left();
+					continue;
+				}
+
+				if (!visitor(node.element_id()))
+					return false;
+			}
+
+			if (stack.empty())
+				return true;
+
+			index = stack.pop();
+		}
+	}
+
+	template<typename Visitor>
+	bool bounding_volume_hierarchy_t::query(const aabb_t& target, Visitor&& visitor)const
+	{
+		return query_nodes(bvh.data(), bvh.size(), target, std::forward<Visitor>(visitor));
+	}
 }
\ No newline at end of file
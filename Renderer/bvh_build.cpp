@@ -0,0 +1,476 @@
+#include "bvh.h"
+#include "parallel.h"
+#include <algorithm>
+#include <cfloat>
+
+// Top-down builders for bounding_volume_hierarchy_t
+namespace
+{
+	using end::float3;
+	using end::aabb_t;
+	using end::bvh_node_t;
+
+	// Number of buckets the centroid range is split into when evaluating SAH splits
+	constexpr uint32_t SAH_BIN_COUNT = 16;
+
+	// min/max form of an aabb, cheaper to grow than center/extents
+	struct bounds_t
+	{
+		float3 min = { FLT_MAX, FLT_MAX, FLT_MAX };
+		float3 max = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+
+		void grow(const float3& point)
+		{
+			min = { std::min(min.x, point.x), std::min(min.y, point.y), std::min(min.z, point.z) };
+			max = { std::max(max.x, point.x), std::max(max.y, point.y), std::max(max.z, point.z) };
+		}
+
+		void grow(const bounds_t& other)
+		{
+			grow(other.min);
+			grow(other.max);
+		}
+
+		float surface_area()const
+		{
+			if (min.x > max.x)
+				return 0.0f;
+
+			float3 size = max - min;
+			return 2.0f * (size.x * size.y + size.y * size.z + size.z * size.x);
+		}
+	};
+
+	// Per-element data used while building
+	struct build_ref_t
+	{
+		bounds_t bounds;
+		float3 centroid;
+		aabb_t aabb;
+		uint32_t element_id;
+	};
+
+	struct sah_bin_t
+	{
+		bounds_t bounds;
+		uint32_t count = 0;
+	};
+
+	// Reorders refs[0, count) around a split and returns the number of refs on the left side.
+	// Always returns a value in [1, count - 1].
+	uint32_t partition_refs(build_ref_t* refs, uint32_t count)
+	{
+		bounds_t centroid_bounds;
+		for (uint32_t i = 0; i < count; i++)
+			centroid_bounds.grow(refs[i].centroid);
+
+		float3 size = centroid_bounds.max - centroid_bounds.min;
+		int axis = 0;
+		if (size.y > size[axis])
+			axis = 1;
+		if (size.z > size[axis])
+			axis = 2;
+
+		// All centroids are in the same spot, any split is as good as another
+		if (size[axis] <= 0.0f)
+			return count / 2;
+
+		float axis_min = centroid_bounds.min[axis];
+		float bin_scale = SAH_BIN_COUNT / size[axis];
+		auto bin_of = [&](const build_ref_t& ref)
+		{
+			uint32_t bin = (uint32_t)((ref.centroid[axis] - axis_min) * bin_scale);
+			return std::min(bin, SAH_BIN_COUNT - 1);
+		};
+
+		sah_bin_t bins[SAH_BIN_COUNT];
+		for (uint32_t i = 0; i < count; i++)
+		{
+			sah_bin_t& bin = bins[bin_of(refs[i])];
+			bin.bounds.grow(refs[i].bounds);
+			bin.count++;
+		}
+
+		// Sweep from the right to get the cost of everything right of each split plane
+		float right_cost[SAH_BIN_COUNT - 1];
+		bounds_t right_bounds;
+		uint32_t right_count = 0;
+		for (uint32_t i = SAH_BIN_COUNT - 1; i > 0; i--)
+		{
+			right_bounds.grow(bins[i].bounds);
+			right_count += bins[i].count;
+			right_cost[i - 1] = right_bounds.surface_area() * right_count;
+		}
+
+		// Then sweep from the left, keeping the cheapest split
+		bounds_t left_bounds;
+		uint32_t left_count = 0;
+		uint32_t best_split = 0;
+		float best_cost = FLT_MAX;
+		for (uint32_t i = 0; i < SAH_BIN_COUNT - 1; i++)
+		{
+			left_bounds.grow(bins[i].bounds);
+			left_count += bins[i].count;
+
+			float cost = left_bounds.surface_area() * left_count + right_cost[i];
+			if (left_count > 0 && left_count < count && cost < best_cost)
+			{
+				best_cost = cost;
+				best_split = i;
+			}
+		}
+
+		build_ref_t* middle = std::partition(refs, refs + count,
+			[&](const build_ref_t& ref) { return bin_of(ref) <= best_split; });
+		uint32_t left_size = (uint32_t)(middle - refs);
+
+		// Every centroid landed in one bin, fall back to a median split
+		if (left_size == 0 || left_size == count)
+		{
+			left_size = count / 2;
+			std::nth_element(refs, refs + left_size, refs + count,
+				[axis](const build_ref_t& a, const build_ref_t& b) { return a.centroid[axis] < b.centroid[axis]; });
+		}
+
+		return left_size;
+	}
+
+	// Writes the subtree for refs[0, count) depth-first, with its root at nodes[index].
+	//
+	// A subtree with n leaves always takes 2n - 1 nodes, so the right child's index
+	// is known as soon as the left side's size is, and disjoint subtrees can be
+	// written at the same time.
+	void build_subtree(bvh_node_t* nodes, uint32_t index, build_ref_t* refs, uint32_t count, uint32_t parent)
+	{
+		if (count == 1)
+		{
+			nodes[index] = bvh_node_t(refs[0].aabb, refs[0].element_id);
+			nodes[index].set_parent(parent);
+			return;
+		}
+
+		uint32_t left_count = partition_refs(refs, count);
+		uint32_t left = index + 1;
+		uint32_t right = left + 2 * left_count - 1;
+		build_subtree(nodes, left, refs, left_count, index);
+		build_subtree(nodes, right, refs + left_count, count - left_count, index);
+
+		nodes[index] = bvh_node_t(nodes, left, right);
+		nodes[index].set_parent(parent);
+	}
+
+	// A range of refs still waiting to be turned into a subtree
+	struct build_task_t
+	{
+		uint32_t index;
+		uint32_t first;
+		uint32_t count;
+		uint32_t parent;
+	};
+
+	// A branch above the per-thread subtrees, finished once its children are built
+	struct top_branch_t
+	{
+		uint32_t index;
+		uint32_t left;
+		uint32_t right;
+		uint32_t parent;
+	};
+
+	// Subtrees smaller than this are never split across threads
+	constexpr uint32_t MIN_PARALLEL_BUILD_COUNT = 1024;
+
+	void make_refs(std::vector<build_ref_t>& refs, const aabb_t* aabbs, const uint32_t* element_ids, uint32_t count, uint32_t thread_count)
+	{
+		refs.resize(count);
+
+		const uint32_t chunk_size = 4096;
+		uint32_t chunk_count = (count + chunk_size - 1) / chunk_size;
+		end::parallel_for(chunk_count, [&](uint32_t chunk)
+		{
+			uint32_t end_index = std::min(count, (chunk + 1) * chunk_size);
+			for (uint32_t i = chunk * chunk_size; i < end_index; i++)
+			{
+				build_ref_t& ref = refs[i];
+				ref.aabb = aabbs[i];
+				ref.element_id = element_ids[i];
+				ref.centroid = aabbs[i].center;
+				ref.bounds.min = aabbs[i].center - aabbs[i].extents;
+				ref.bounds.max = aabbs[i].center + aabbs[i].extents;
+			}
+		}, thread_count);
+	}
+
+	// Sorts (key, value) pairs by key with an LSD radix sort, 8 bits per pass.
+	// 'keys'/'values' hold the result, 'key_temp'/'value_temp' are scratch space of the same size.
+	template<typename Key>
+	void radix_sort(Key* keys, uint32_t* values, Key* key_temp, uint32_t* value_temp, uint32_t count, uint32_t key_bits)
+	{
+		for (uint32_t shift = 0; shift < key_bits; shift += 8)
+		{
+			uint32_t offsets[256] = {};
+			for (uint32_t i = 0; i < count; i++)
+				offsets[(keys[i] >> shift) & 0xFF]++;
+
+			// Every key has the same digit, this pass wouldn't move anything
+			if (offsets[(keys[0] >> shift) & 0xFF] == count)
+				continue;
+
+			uint32_t sum = 0;
+			for (uint32_t& offset : offsets)
+			{
+				uint32_t digit_count = offset;
+				offset = sum;
+				sum += digit_count;
+			}
+
+			for (uint32_t i = 0; i < count; i++)
+			{
+				uint32_t dst = offsets[(keys[i] >> shift) & 0xFF]++;
+				key_temp[dst] = keys[i];
+				value_temp[dst] = values[i];
+			}
+
+			std::copy(key_temp, key_temp + count, keys);
+			std::copy(value_temp, value_temp + count, values);
+		}
+	}
+
+	// Returns a value with only the highest set bit of 'v' set
+	template<typename Key>
+	Key highest_bit(Key v)
+	{
+		for (uint32_t shift = 1; shift < sizeof(Key) * 8; shift <<= 1)
+			v |= v >> shift;
+
+		return v - (v >> 1);
+	}
+
+	// Writes the subtree for sorted codes [first, last] depth-first, with its root at nodes[index].
+	// Each range is split where its highest differing Morton bit flips.
+	template<typename Key>
+	void emit_lbvh_subtree(bvh_node_t* nodes, uint32_t index, const Key* codes, const uint32_t* order,
+		const aabb_t* aabbs, const uint32_t* element_ids, uint32_t first, uint32_t last, uint32_t parent)
+	{
+		if (first == last)
+		{
+			uint32_t element = order[first];
+			nodes[index] = bvh_node_t(aabbs[element], element_ids[element]);
+			nodes[index].set_parent(parent);
+			return;
+		}
+
+		uint32_t split;
+		Key differing_bits = codes[first] ^ codes[last];
+		if (differing_bits == 0)
+		{
+			// Duplicate codes, split the range in half
+			split = (first + last) / 2;
+		}
+		else
+		{
+			// Codes are sorted, so everything with the top differing bit clear comes first
+			Key top_bit = highest_bit(differing_bits);
+			const Key* right_start = std::partition_point(codes + first, codes + last + 1,
+				[top_bit](Key code) { return (code & top_bit) == 0; });
+			split = (uint32_t)(right_start - codes) - 1;
+		}
+
+		uint32_t left_count = split - first + 1;
+		uint32_t left = index + 1;
+		uint32_t right = left + 2 * left_count - 1;
+		emit_lbvh_subtree(nodes, left, codes, order, aabbs, element_ids, first, split, index);
+		emit_lbvh_subtree(nodes, right, codes, order, aabbs, element_ids, split + 1, last, index);
+
+		nodes[index] = bvh_node_t(nodes, left, right);
+		nodes[index].set_parent(parent);
+	}
+
+	template<typename Key>
+	void build_lbvh_with(std::vector<bvh_node_t>& nodes, const aabb_t* aabbs, const uint32_t* element_ids, uint32_t count,
+		uint32_t bits_per_axis, Key(*encode)(uint32_t, uint32_t, uint32_t))
+	{
+		// Scratch space is kept between calls so per-frame rebuilds don't allocate
+		thread_local std::vector<Key> codes;
+		thread_local std::vector<Key> code_temp;
+		thread_local std::vector<uint32_t> order;
+		thread_local std::vector<uint32_t> order_temp;
+		codes.resize(count);
+		code_temp.resize(count);
+		order.resize(count);
+		order_temp.resize(count);
+
+		bounds_t centroid_bounds;
+		for (uint32_t i = 0; i < count; i++)
+			centroid_bounds.grow(aabbs[i].center);
+
+		// Map the centroid bounds onto the integer grid, guarding flat axes
+		const float grid_max = (float)((1u << bits_per_axis) - 1);
+		float3 size = centroid_bounds.max - centroid_bounds.min;
+		float3 scale = {
+			size.x > 0.0f ? grid_max / size.x : 0.0f,
+			size.y > 0.0f ? grid_max / size.y : 0.0f,
+			size.z > 0.0f ? grid_max / size.z : 0.0f
+		};
+
+		for (uint32_t i = 0; i < count; i++)
+		{
+			float3 cell = (aabbs[i].center - centroid_bounds.min) * scale;
+			codes[i] = encode(
+				(uint32_t)std::min(cell.x, grid_max),
+				(uint32_t)std::min(cell.y, grid_max),
+				(uint32_t)std::min(cell.z, grid_max));
+			order[i] = i;
+		}
+
+		radix_sort(codes.data(), order.data(), code_temp.data(), order_temp.data(), count, bits_per_axis * 3);
+
+		nodes.resize(2 * (size_t)count - 1);
+		emit_lbvh_subtree(nodes.data(), 0, codes.data(), order.data(), aabbs, element_ids, 0, count - 1, UINT32_MAX);
+	}
+
+	// Spreads the low 10 bits of v so there are two zero bits between each
+	uint32_t expand_bits_10(uint32_t v)
+	{
+		v &= 0x3FF;
+		v = (v | (v << 16)) & 0x030000FF;
+		v = (v | (v << 8)) & 0x0300F00F;
+		v = (v | (v << 4)) & 0x030C30C3;
+		v = (v | (v << 2)) & 0x09249249;
+		return v;
+	}
+
+	// Spreads the low 21 bits of v so there are two zero bits between each
+	uint64_t expand_bits_21(uint64_t v)
+	{
+		v &= 0x1FFFFF;
+		v = (v | (v << 32)) & 0x001F00000000FFFFull;
+		v = (v | (v << 16)) & 0x001F0000FF0000FFull;
+		v = (v | (v << 8)) & 0x100F00F00F00F00Full;
+		v = (v | (v << 4)) & 0x10C30C30C30C30C3ull;
+		v = (v | (v << 2)) & 0x1249249249249249ull;
+		return v;
+	}
+}
+
+namespace end
+{
+	uint32_t morton_code_30(uint32_t x, uint32_t y, uint32_t z)
+	{
+		return (expand_bits_10(x) << 2) | (expand_bits_10(y) << 1) | expand_bits_10(z);
+	}
+
+	uint64_t morton_code_63(uint32_t x, uint32_t y, uint32_t z)
+	{
+		return (expand_bits_21(x) << 2) | (expand_bits_21(y) << 1) | expand_bits_21(z);
+	}
+
+	void bounding_volume_hierarchy_t::build(const aabb_t* aabbs, const uint32_t* element_ids, uint32_t count)
+	{
+		bvh.clear();
+		element_leaves.clear();
+
+		if (count == 0)
+			return;
+
+		std::vector<build_ref_t> refs;
+		make_refs(refs, aabbs, element_ids, count, 1);
+
+		bvh.resize(2 * (size_t)count - 1);
+		build_subtree(bvh.data(), 0, refs.data(), count, UINT32_MAX);
+
+		update_element_leaves();
+	}
+
+	void bounding_volume_hierarchy_t::build_parallel(const aabb_t* aabbs, const uint32_t* element_ids, uint32_t count, uint32_t thread_count)
+	{
+		bvh.clear();
+		element_leaves.clear();
+
+		if (count == 0)
+			return;
+
+		if (thread_count == 0)
+			thread_count = default_thread_count();
+
+		std::vector<build_ref_t> refs;
+		make_refs(refs, aabbs, element_ids, count, thread_count);
+
+		bvh.resize(2 * (size_t)count - 1);
+
+		// Split breadth-first, one thread per range, until there are enough ranges to keep every thread busy
+		std::vector<build_task_t> tasks = { { 0, 0, count, UINT32_MAX } };
+		std::vector<build_task_t> next_tasks;
+		std::vector<top_branch_t> top_branches;
+		std::vector<uint32_t> split_counts;
+		const uint32_t target_task_count = thread_count * 4;
+
+		while (tasks.size() < target_task_count)
+		{
+			split_counts.assign(tasks.size(), 0);
+			parallel_for((uint32_t)tasks.size(), [&](uint32_t i)
+			{
+				const build_task_t& task = tasks[i];
+				if (task.count >= MIN_PARALLEL_BUILD_COUNT)
+					split_counts[i] = partition_refs(refs.data() + task.first, task.count);
+			}, thread_count);
+
+			next_tasks.clear();
+			for (size_t i = 0; i < tasks.size(); i++)
+			{
+				const build_task_t& task = tasks[i];
+				uint32_t left_count = split_counts[i];
+
+				if (left_count == 0)
+				{
+					next_tasks.push_back(task);
+					continue;
+				}
+
+				uint32_t left = task.index + 1;
+				uint32_t right = left + 2 * left_count - 1;
+				top_branches.push_back({ task.index, left, right, task.parent });
+				next_tasks.push_back({ left, task.first, left_count, task.index });
+				next_tasks.push_back({ right, task.first + left_count, task.count - left_count, task.index });
+			}
+
+			if (next_tasks.size() == tasks.size())
+				break;
+
+			tasks.swap(next_tasks);
+		}
+
+		// The remaining ranges cover disjoint node ranges, so each can be built on its own
+		parallel_for((uint32_t)tasks.size(), [&](uint32_t i)
+		{
+			const build_task_t& task = tasks[i];
+			build_subtree(bvh.data(), task.index, refs.data() + task.first, task.count, task.parent);
+		}, thread_count);
+
+		// Parents were recorded before their children, so walking backwards finishes children first
+		for (auto branch = top_branches.rbegin(); branch != top_branches.rend(); ++branch)
+		{
+			bvh[branch->index] = bvh_node_t(bvh.data(), branch->left, branch->right);
+			bvh[branch->index].set_parent(branch->parent);
+		}
+
+		update_element_leaves();
+	}
+
+	void bounding_volume_hierarchy_t::build_lbvh(const aabb_t* aabbs, const uint32_t* element_ids, uint32_t count, bool use_63bit_codes)
+	{
+		if (count == 0)
+		{
+			bvh.clear();
+			element_leaves.clear();
+			return;
+		}
+
+		if (use_63bit_codes)
+			build_lbvh_with<uint64_t>(bvh, aabbs, element_ids, count, 21, morton_code_63);
+		else
+			build_lbvh_with<uint32_t>(bvh, aabbs, element_ids, count, 10, morton_code_30);
+
+		update_element_leaves();
+	}
+}
\ No newline at end of file
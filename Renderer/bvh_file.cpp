@@ -0,0 +1,249 @@
+#include "bvh_file.h"
+#include <cstring>
+#include <fstream>
+#include <vector>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+	using namespace end;
+
+	uint64_t align_up(uint64_t value)
+	{
+		return (value + BVH_FILE_ALIGNMENT - 1) & ~(uint64_t)(BVH_FILE_ALIGNMENT - 1);
+	}
+
+	// The file stores nodes exactly as they are in memory, so it's only valid on little-endian hosts
+	bool is_little_endian()
+	{
+		const uint32_t value = 1;
+		return *(const uint8_t*)&value == 1;
+	}
+
+	uint64_t payload_checksum(const void* nodes, uint32_t node_count, const void* element_leaves, uint32_t element_count)
+	{
+		uint64_t hash = fnv1a_64(nodes, (size_t)node_count * sizeof(bvh_node_t));
+		return fnv1a_64(element_leaves, (size_t)element_count * sizeof(uint32_t), hash);
+	}
+
+	// Checks that every index in the tree points inside it.
+	// Builders put children after their parent, so requiring that also rules out cycles.
+	bool indices_valid(const bvh_node_t* nodes, uint32_t node_count, const uint32_t* element_leaves, uint32_t element_count)
+	{
+		for (uint32_t i = 0; i < node_count; i++)
+		{
+			const bvh_node_t& node = nodes[i];
+
+			if (i == 0 ? !node.is_root() : (node.is_root() || node.parent() >= i))
+				return false;
+
+			if (node.is_branch())
+			{
+				if (node.left() <= i || node.left() >= node_count || node.right() <= i || node.right() >= node_count)
+					return false;
+			}
+			else if (node.element_id() >= element_count)
+				return false;
+		}
+
+		for (uint32_t i = 0; i < element_count; i++)
+		{
+			if (element_leaves[i] != UINT32_MAX && element_leaves[i] >= node_count)
+				return false;
+		}
+
+		return true;
+	}
+}
+
+namespace end
+{
+	uint64_t fnv1a_64(const void* data, size_t size, uint64_t hash)
+	{
+		const uint8_t* bytes = (const uint8_t*)data;
+		for (size_t i = 0; i < size; i++)
+		{
+			hash ^= bytes[i];
+			hash *= 0x100000001b3ull;
+		}
+
+		return hash;
+	}
+
+	bool save_bvh(const char* path, const bvh_t& tree, uint64_t source_checksum)
+	{
+		if (!is_little_endian())
+			return false;
+
+		bvh_file_header_t header = {};
+		header.magic = BVH_FILE_MAGIC;
+		header.version = BVH_FILE_VERSION;
+		header.node_size = sizeof(bvh_node_t);
+		header.node_count = (uint32_t)tree.bvh.size();
+		header.element_count = (uint32_t)tree.element_leaves.size();
+		header.source_checksum = source_checksum;
+
+		header.node_offset = align_up(sizeof(bvh_file_header_t));
+		header.element_leaves_offset = align_up(header.node_offset + (uint64_t)header.node_count * sizeof(bvh_node_t));
+		header.file_size = align_up(header.element_leaves_offset + (uint64_t)header.element_count * sizeof(uint32_t));
+
+		// Lay the whole file out in memory, padding included, and write it in one go
+		std::vector<char> file_data((size_t)header.file_size, 0);
+		memcpy(file_data.data(), &header, sizeof(header));
+		if (header.node_count)
+			memcpy(file_data.data() + header.node_offset, tree.bvh.data(), header.node_count * sizeof(bvh_node_t));
+		if (header.element_count)
+			memcpy(file_data.data() + header.element_leaves_offset, tree.element_leaves.data(), header.element_count * sizeof(uint32_t));
+
+		// Hashed from the buffer, so the checksum covers exactly the bytes that get written
+		header.payload_checksum = payload_checksum(file_data.data() + header.node_offset, header.node_count,
+			file_data.data() + header.element_leaves_offset, header.element_count);
+		memcpy(file_data.data(), &header, sizeof(header));
+
+		std::ofstream file{ path, std::ios_base::out | std::ios_base::binary | std::ios_base::trunc };
+		if (!file)
+			return false;
+
+		file.write(file_data.data(), file_data.size());
+		return (bool)file;
+	}
+
+	bool mapped_bvh_t::open(const char* path, uint64_t source_checksum)
+	{
+		close();
+
+		if (!is_little_endian())
+			return false;
+
+#ifdef _WIN32
+		HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file == INVALID_HANDLE_VALUE)
+			return false;
+
+		LARGE_INTEGER file_size;
+		if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart < (LONGLONG)sizeof(bvh_file_header_t))
+		{
+			CloseHandle(file);
+			return false;
+		}
+
+		HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (!mapping)
+		{
+			CloseHandle(file);
+			return false;
+		}
+
+		view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		file_handle = file;
+		mapping_handle = mapping;
+
+		if (!view)
+		{
+			close();
+			return false;
+		}
+
+		view_size = (size_t)file_size.QuadPart;
+#else
+		file_descriptor = ::open(path, O_RDONLY);
+		if (file_descriptor < 0)
+			return false;
+
+		struct stat file_stat;
+		if (fstat(file_descriptor, &file_stat) != 0 || file_stat.st_size < (off_t)sizeof(bvh_file_header_t))
+		{
+			close();
+			return false;
+		}
+
+		void* mapped = mmap(nullptr, (size_t)file_stat.st_size, PROT_READ, MAP_PRIVATE, file_descriptor, 0);
+		if (mapped == MAP_FAILED)
+		{
+			close();
+			return false;
+		}
+
+		view = mapped;
+		view_size = (size_t)file_stat.st_size;
+#endif
+
+		// Validate everything before handing out pointers into the file
+		const uint8_t* bytes = (const uint8_t*)view;
+		const bvh_file_header_t* file_header = (const bvh_file_header_t*)bytes;
+
+		bool valid = file_header->magic == BVH_FILE_MAGIC
+			&& file_header->version == BVH_FILE_VERSION
+			&& file_header->node_size == sizeof(bvh_node_t)
+			&& file_header->source_checksum == source_checksum
+			&& file_header->file_size == view_size
+			&& file_header->node_offset % BVH_FILE_ALIGNMENT == 0
+			&& file_header->element_leaves_offset % BVH_FILE_ALIGNMENT == 0
+			&& file_header->node_offset + (uint64_t)file_header->node_count * sizeof(bvh_node_t) <= view_size
+			&& file_header->element_leaves_offset + (uint64_t)file_header->element_count * sizeof(uint32_t) <= view_size;
+
+		if (!valid)
+		{
+			close();
+			return false;
+		}
+
+		const bvh_node_t* file_nodes = (const bvh_node_t*)(bytes + file_header->node_offset);
+		const uint32_t* file_element_leaves = (const uint32_t*)(bytes + file_header->element_leaves_offset);
+
+		// The header only describes the payload, a bit flip or partial write inside it would still pass above
+		valid = payload_checksum(file_nodes, file_header->node_count, file_element_leaves, file_header->element_count) == file_header->payload_checksum
+			&& indices_valid(file_nodes, file_header->node_count, file_element_leaves, file_header->element_count);
+
+		if (!valid)
+		{
+			close();
+			return false;
+		}
+
+		header = file_header;
+		nodes_data = file_nodes;
+		element_leaves_data = file_element_leaves;
+
+		return true;
+	}
+
+	void mapped_bvh_t::close()
+	{
+		header = nullptr;
+		nodes_data = nullptr;
+		element_leaves_data = nullptr;
+
+#ifdef _WIN32
+		if (view)
+			UnmapViewOfFile(view);
+		if (mapping_handle)
+			CloseHandle(mapping_handle);
+		if (file_handle)
+			CloseHandle(file_handle);
+
+		file_handle = nullptr;
+		mapping_handle = nullptr;
+#else
+		if (view)
+			munmap(view, view_size);
+		if (file_descriptor >= 0)
+			::close(file_descriptor);
+
+		file_descriptor = -1;
+#endif
+
+		view = nullptr;
+		view_size = 0;
+	}
+}
\ No newline at end of file
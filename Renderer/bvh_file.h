@@ -0,0 +1,111 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+
+#include "bvh.h"
+
+namespace end
+{
+	// "BVHF" when read as little-endian bytes
+	constexpr uint32_t BVH_FILE_MAGIC = 0x46485642;
+
+	// Bump whenever the layout of the file or of bvh_node_t changes
+	constexpr uint32_t BVH_FILE_VERSION = 2;
+
+	// Every section of the file starts on this boundary
+	constexpr uint32_t BVH_FILE_ALIGNMENT = 64;
+
+	// bvh_file_header_t
+	//
+	// Start of a bvh file. All values are little-endian.
+	// The header is followed by the node array (bvh_t::bvh), then the element_leaves array.
+	struct bvh_file_header_t
+	{
+		uint32_t magic;
+		uint32_t version;
+
+		// sizeof(bvh_node_t) when the file was written
+		uint32_t node_size;
+		uint32_t node_count;
+
+		// Byte offsets of the node and element_leaves arrays from the start of the file
+		uint64_t node_offset;
+		uint64_t element_leaves_offset;
+
+		uint32_t element_count;
+		uint32_t reserved;
+
+		// Checksum of the data the tree was built from, see fnv1a_64()
+		uint64_t source_checksum;
+
+		uint64_t file_size;
+
+		// fnv1a_64() of the node array followed by the element_leaves array
+		uint64_t payload_checksum;
+	};
+
+	static_assert(sizeof(bvh_file_header_t) == BVH_FILE_ALIGNMENT, "bvh file header must fill one aligned block");
+
+	// 64-bit FNV-1a hash of 'size' bytes.
+	// Pass the previous result as 'hash' to checksum data in several pieces.
+	uint64_t fnv1a_64(const void* data, size_t size, uint64_t hash = 0xcbf29ce484222325ull);
+
+	// Writes 'tree' to a bvh file at 'path'.
+	// Returns false if the file couldn't be written.
+	bool save_bvh(const char* path, const bvh_t& tree, uint64_t source_checksum);
+
+	// mapped_bvh_t
+	//
+	// Read-only bvh file mapped into memory.
+	// The node array is used in place, so opening costs no more than mapping the file.
+	class mapped_bvh_t
+	{
+	public:
+		mapped_bvh_t() = default;
+		mapped_bvh_t(const mapped_bvh_t&) = delete;
+		mapped_bvh_t& operator=(const mapped_bvh_t&) = delete;
+
+		~mapped_bvh_t() { close(); }
+
+		// Maps the bvh file at 'path'.
+		// Fails if the file is missing, damaged, from another version, or wasn't built
+		// from data matching 'source_checksum'. A failed open leaves the object closed.
+		// Damage is caught by the payload checksum, and every child, parent and element index
+		// is bounds checked as well, so the nodes are safe to traverse once this returns true.
+		bool open(const char* path, uint64_t source_checksum);
+
+		void close();
+
+		inline bool is_open()const { return header != nullptr; }
+
+		inline const bvh_node_t* nodes()const { return nodes_data; }
+
+		inline size_t node_count()const { return header ? header->node_count : 0; }
+
+		inline const uint32_t* element_leaves()const { return element_leaves_data; }
+
+		inline size_t element_count()const { return header ? header->element_count : 0; }
+
+		// Same as bvh_t::query, run directly on the mapped nodes
+		template<typename Visitor>
+		bool query(const aabb_t& target, Visitor&& visitor)const
+		{
+			return query_nodes(nodes_data, node_count(), target, std::forward<Visitor>(visitor));
+		}
+
+	private:
+		const bvh_file_header_t* header = nullptr;
+		const bvh_node_t* nodes_data = nullptr;
+		const uint32_t* element_leaves_data = nullptr;
+
+		// Mapped view and the OS handles that keep it alive
+		void* view = nullptr;
+		size_t view_size = 0;
+#ifdef _WIN32
+		void* file_handle = nullptr;
+		void* mapping_handle = nullptr;
+#else
+		int file_descriptor = -1;
+#endif
+	};
+}
\ No newline at end of file
@@ -0,0 +1,264 @@
+#include "bvh.h"
+#include "parallel.h"
+#include <algorithm>
+#include <cfloat>
+
+// Treelet restructuring for bounding_volume_hierarchy_t
+namespace
+{
+	using end::aabb_t;
+	using end::bvh_node_t;
+	using end::BVH_TREELET_SIZE;
+
+	constexpr uint32_t TREELET_SUBSET_COUNT = 1u << BVH_TREELET_SIZE;
+
+	// Node slots reused by a treelet: its leaves (subtrees left as they are),
+	// and the branches above them that get rearranged
+	struct treelet_t
+	{
+		uint32_t leaves[BVH_TREELET_SIZE];
+		uint32_t leaf_count = 0;
+
+		uint32_t branches[BVH_TREELET_SIZE - 1];
+		uint32_t branch_count = 0;
+	};
+
+	// Grows the treelet under 'root' by opening its largest branch until it's full
+	void form_treelet(const std::vector<bvh_node_t>& nodes, uint32_t root, treelet_t& treelet)
+	{
+		treelet.leaves[treelet.leaf_count++] = nodes[root].left();
+		treelet.leaves[treelet.leaf_count++] = nodes[root].right();
+
+		while (treelet.leaf_count < BVH_TREELET_SIZE)
+		{
+			uint32_t best_slot = UINT32_MAX;
+			float best_area = -1.0f;
+			for (uint32_t i = 0; i < treelet.leaf_count; i++)
+			{
+				const bvh_node_t& node = nodes[treelet.leaves[i]];
+				float area = end::surface_area(node.aabb());
+				if (node.is_branch() && area > best_area)
+				{
+					best_area = area;
+					best_slot = i;
+				}
+			}
+
+			if (best_slot == UINT32_MAX)
+				break;
+
+			const bvh_node_t& opened = nodes[treelet.leaves[best_slot]];
+			treelet.branches[treelet.branch_count++] = treelet.leaves[best_slot];
+			treelet.leaves[best_slot] = opened.left();
+			treelet.leaves[treelet.leaf_count++] = opened.right();
+		}
+	}
+
+	// Scratch for solving one treelet, indexed by subsets of its leaves
+	struct treelet_solution_t
+	{
+		aabb_t aabbs[TREELET_SUBSET_COUNT];
+		float costs[TREELET_SUBSET_COUNT];
+		uint8_t splits[TREELET_SUBSET_COUNT];
+	};
+
+	// Finds the lowest cost topology for every subset of the treelet's leaves.
+	// The cost of a subtree is the surface area of its branches plus its leaves (see bvh_stats_t).
+	void solve_treelet(const treelet_t& treelet, const float* subtree_costs, const std::vector<bvh_node_t>& nodes, treelet_solution_t& solution)
+	{
+		uint32_t full_set = (1u << treelet.leaf_count) - 1;
+
+		for (uint32_t i = 0; i < treelet.leaf_count; i++)
+		{
+			solution.aabbs[1u << i] = nodes[treelet.leaves[i]].aabb();
+			solution.costs[1u << i] = subtree_costs[treelet.leaves[i]];
+		}
+
+		// Subsets only split into smaller ones, so increasing order solves the parts first
+		for (uint32_t set = 3; set <= full_set; set++)
+		{
+			uint32_t lowest = set & (0u - set);
+			if (set == lowest)
+				continue;
+
+			solution.aabbs[set] = end::encapsulate(solution.aabbs[set ^ lowest], solution.aabbs[lowest]);
+
+			// Only splits whose left side holds the lowest leaf, the mirrored ones cost the same
+			float best_cost = FLT_MAX;
+			uint32_t best_split = 0;
+			for (uint32_t part = (set - 1) & set; part; part = (part - 1) & set)
+			{
+				if (!(part & lowest))
+					continue;
+
+				float cost = solution.costs[part] + solution.costs[set ^ part];
+				if (cost < best_cost)
+				{
+					best_cost = cost;
+					best_split = part;
+				}
+			}
+
+			solution.costs[set] = end::surface_area(solution.aabbs[set]) + best_cost;
+			solution.splits[set] = (uint8_t)best_split;
+		}
+	}
+
+	// Rewrites the treelet's branches to match the solution for 'set' (two or more leaves),
+	// with the subtree's root stored at 'index'. Branches below it are taken from the treelet in order.
+	void emit_treelet(std::vector<bvh_node_t>& nodes, float* subtree_costs, const treelet_t& treelet,
+		const treelet_solution_t& solution, uint32_t set, uint32_t index, uint32_t& next_branch)
+	{
+		uint32_t children[2];
+		uint32_t parts[2] = { solution.splits[set], set ^ solution.splits[set] };
+
+		for (uint32_t i = 0; i < 2; i++)
+		{
+			uint32_t part = parts[i];
+			if ((part & (part - 1)) == 0)
+			{
+				uint32_t leaf_slot = 0;
+				while (!(part & (1u << leaf_slot)))
+					leaf_slot++;
+
+				children[i] = treelet.leaves[leaf_slot];
+				continue;
+			}
+
+			children[i] = treelet.branches[next_branch++];
+			emit_treelet(nodes, subtree_costs, treelet, solution, part, children[i], next_branch);
+		}
+
+		uint32_t parent = nodes[index].is_root() ? UINT32_MAX : nodes[index].parent();
+		nodes[index] = bvh_node_t(nodes.data(), children[0], children[1]);
+		nodes[index].set_parent(parent);
+		nodes[children[0]].set_parent(index);
+		nodes[children[1]].set_parent(index);
+
+		subtree_costs[index] = solution.costs[set];
+	}
+}
+
+namespace end
+{
+	void bounding_volume_hierarchy_t::optimize_treelets(uint32_t iterations, uint32_t thread_count)
+	{
+		if (bvh.size() < 5)
+			return;
+
+		std::vector<float> subtree_costs(bvh.size());
+		std::vector<uint32_t> depths(bvh.size());
+		std::vector<std::vector<uint32_t>> levels;
+
+		for (uint32_t iteration = 0; iteration < iterations; iteration++)
+		{
+			// Group the branches by depth, and find the cost of every subtree.
+			// Treelets move nodes around, so the order is found again on every iteration.
+			levels.clear();
+			std::vector<uint32_t> order;
+			order.reserve(bvh.size());
+			order.push_back(0);
+			depths[0] = 0;
+
+			for (size_t i = 0; i < order.size(); i++)
+			{
+				const bvh_node_t& node = bvh[order[i]];
+				if (node.is_leaf())
+					continue;
+
+				uint32_t depth = depths[order[i]];
+				if (levels.size() <= depth)
+					levels.resize(depth + 1);
+				levels[depth].push_back(order[i]);
+
+				depths[node.left()] = depth + 1;
+				depths[node.right()] = depth + 1;
+				order.push_back(node.left());
+				order.push_back(node.right());
+			}
+
+			for (size_t i = order.size(); i-- > 0;)
+			{
+				const bvh_node_t& node = bvh[order[i]];
+				subtree_costs[order[i]] = surface_area(node.aabb());
+				if (node.is_branch())
+					subtree_costs[order[i]] += subtree_costs[node.left()] + subtree_costs[node.right()];
+			}
+
+			// Treelets only rearrange nodes under their root, so roots at the same depth are independent
+			std::atomic<bool> improved{ false };
+			for (size_t depth = levels.size(); depth-- > 0;)
+			{
+				const std::vector<uint32_t>& roots = levels[depth];
+
+				parallel_for((uint32_t)roots.size(), [&](uint32_t i)
+				{
+					uint32_t root = roots[i];
+
+					treelet_t treelet;
+					form_treelet(bvh, root, treelet);
+
+					// Two or three leaves only have one topology up to mirroring
+					if (treelet.leaf_count < 3)
+						return;
+
+					treelet_solution_t solution;
+					solve_treelet(treelet, subtree_costs.data(), bvh, solution);
+
+					uint32_t full_set = (1u << treelet.leaf_count) - 1;
+					if (solution.costs[full_set] >= subtree_costs[root] * (1.0f - 1e-5f))
+						return;
+
+					uint32_t next_branch = 0;
+					emit_treelet(bvh, subtree_costs.data(), treelet, solution, full_set, root, next_branch);
+					improved = true;
+				}, roots.size() > 64 ? thread_count : 1);
+			}
+
+			if (!improved)
+				break;
+		}
+
+		// Store the nodes depth-first again, so children come after their parents
+		std::vector<bvh_node_t> sorted_nodes;
+		sorted_nodes.reserve(bvh.size());
+
+		struct pending_t
+		{
+			uint32_t index;
+			uint32_t parent;
+			bool is_right;
+		};
+
+		std::vector<pending_t> stack;
+		stack.push_back({ 0, UINT32_MAX, false });
+
+		while (!stack.empty())
+		{
+			pending_t pending = stack.back();
+			stack.pop_back();
+
+			uint32_t new_index = (uint32_t)sorted_nodes.size();
+			sorted_nodes.push_back(bvh[pending.index]);
+			sorted_nodes.back().set_parent(pending.parent);
+
+			if (pending.parent != UINT32_MAX)
+			{
+				if (pending.is_right)
+					sorted_nodes[pending.parent].right() = new_index;
+				else
+					sorted_nodes[pending.parent].left() = new_index;
+			}
+
+			const bvh_node_t& node = bvh[pending.index];
+			if (node.is_branch())
+			{
+				stack.push_back({ node.right(), new_index, true });
+				stack.push_back({ node.left(), new_index, false });
+			}
+		}
+
+		bvh.swap(sorted_nodes);
+		update_element_leaves();
+	}
+}
\ No newline at end of file
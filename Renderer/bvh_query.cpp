@@ -0,0 +1,685 @@
+#include "bvh.h"
+#include <cmath>
+#include <algorithm>
+#include <functional>
+#include <xmmintrin.h>
+
+namespace
+{
+	using namespace end;
+
+	// Ray with its inverse direction precomputed for slab tests
+	struct ray_t
+	{
+		float3 origin;
+		float3 direction;
+		float3 inv_direction;
+	};
+
+	// Returns the distance at which the ray enters 'aabb', or INFINITY if it misses
+	// the box or only reaches it beyond t_max
+	float slab_test(const ray_t& ray, const aabb_t& aabb, float t_max)
+	{
+		float3 box_min = aabb.center - aabb.extents;
+		float3 box_max = aabb.center + aabb.extents;
+
+		float t_enter = 0.0f;
+		float t_exit = t_max;
+
+		for (int i = 0; i < 3; i++)
+		{
+			float t0 = (box_min[i] - ray.origin[i]) * ray.inv_direction[i];
+			float t1 = (box_max[i] - ray.origin[i]) * ray.inv_direction[i];
+
+			if (t0 > t1)
+				std::swap(t0, t1);
+
+			// Written so a NaN (origin on a slab with a zero direction) leaves the range alone
+			t_enter = t0 > t_enter ? t0 : t_enter;
+			t_exit = t1 < t_exit ? t1 : t_exit;
+		}
+
+		return t_enter <= t_exit ? t_enter : INFINITY;
+	}
+
+	// Moller-Trumbore ray/triangle intersection.
+	// Returns true if the ray hits the triangle closer than 't', and updates t/u/v.
+	bool intersect_triangle(const ray_t& ray, const float3& a, const float3& b, const float3& c, float& t, float& u, float& v)
+	{
+		const float epsilon = 1e-8f;
+
+		float3 edge1 = b - a;
+		float3 edge2 = c - a;
+
+		float3 p = edge1.cross(ray.direction, edge2);
+		float det = edge1.dot(edge1, p);
+
+		// Ray is parallel to the triangle
+		if (fabsf(det) < epsilon)
+			return false;
+
+		float inv_det = 1.0f / det;
+
+		float3 s = ray.origin - a;
+		float hit_u = s.dot(s, p) * inv_det;
+		if (hit_u < 0.0f || hit_u > 1.0f)
+			return false;
+
+		float3 q = s.cross(s, edge1);
+		float hit_v = q.dot(ray.direction, q) * inv_det;
+		if (hit_v < 0.0f || hit_u + hit_v > 1.0f)
+			return false;
+
+		float hit_t = q.dot(edge2, q) * inv_det;
+		if (hit_t < 0.0f || hit_t >= t)
+			return false;
+
+		t = hit_t;
+		u = hit_u;
+		v = hit_v;
+		return true;
+	}
+
+	// Squared distance from a point to the closest point of an aabb, 0 if it's inside
+	float distance_squared(const float3& point, const aabb_t& aabb)
+	{
+		float result = 0.0f;
+		for (int i = 0; i < 3; i++)
+		{
+			float d = fabsf(point[i] - aabb.center[i]) - aabb.extents[i];
+			if (d > 0.0f)
+				result += d * d;
+		}
+
+		return result;
+	}
+
+	// Returns the point on triangle abc closest to p, by finding the Voronoi region p is in
+	// (Ericson, Real-Time Collision Detection 5.1.5)
+	float3 closest_point_on_triangle(const float3& p, const float3& a, const float3& b, const float3& c)
+	{
+		float3 ab = b - a;
+		float3 ac = c - a;
+		float3 ap = p - a;
+
+		float d1 = ab.dot(ab, ap);
+		float d2 = ac.dot(ac, ap);
+		if (d1 <= 0.0f && d2 <= 0.0f)
+			return a;
+
+		float3 bp = p - b;
+		float d3 = ab.dot(ab, bp);
+		float d4 = ac.dot(ac, bp);
+		if (d3 >= 0.0f && d4 <= d3)
+			return b;
+
+		float vc = d1 * d4 - d3 * d2;
+		if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f)
+			return a + ab * (d1 / (d1 - d3));
+
+		float3 cp = p - c;
+		float d5 = ab.dot(ab, cp);
+		float d6 = ac.dot(ac, cp);
+		if (d6 >= 0.0f && d5 <= d6)
+			return c;
+
+		float vb = d5 * d2 - d1 * d6;
+		if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f)
+			return a + ac * (d2 / (d2 - d6));
+
+		float va = d3 * d6 - d5 * d4;
+		if (va <= 0.0f && (d4 - d3) >= 0.0f && (d5 - d6) >= 0.0f)
+			return b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+
+		// Inside the face
+		float denom = 1.0f / (va + vb + vc);
+		return a + ab * (vb * denom) + ac * (vc * denom);
+	}
+
+	// Node or element waiting in a best-first search, ordered by distance
+	struct nearest_t
+	{
+		float distance_squared;
+		uint32_t index;
+
+		inline bool operator>(const nearest_t& other)const { return distance_squared > other.distance_squared; }
+		inline bool operator<(const nearest_t& other)const { return distance_squared < other.distance_squared; }
+	};
+}
+
+namespace end
+{
+	bool bounding_volume_hierarchy_t::raycast(const float3& origin, const float3& direction, float t_max, const quad_t* quads, const pos_norm_uv_vertex* verts, bvh_ray_hit_t& hit)const
+	{
+		hit = bvh_ray_hit_t();
+
+		if (bvh.empty())
+			return false;
+
+		ray_t ray;
+		ray.origin = origin;
+		ray.direction = direction;
+		ray.inv_direction = { 1.0f / direction.x, 1.0f / direction.y, 1.0f / direction.z };
+
+		// Closest hit so far, nodes entered beyond it are skipped
+		float closest = t_max;
+
+		// Pending nodes, along with the distance the ray enters them
+		struct pending_t
+		{
+			uint32_t index;
+			float t_enter;
+		};
+
+		bvh_stack_t<pending_t> stack;
+
+		if (slab_test(ray, bvh[0].aabb(), closest) == INFINITY)
+			return false;
+
+		stack.push({ 0, 0.0f });
+
+		while (!stack.empty())
+		{
+			pending_t pending = stack.pop();
+			if (pending.t_enter > closest)
+				continue;
+
+			const bvh_node_t& node = bvh[pending.index];
+
+			if (node.is_leaf())
+			{
+				const quad_t& quad = quads[node.element_id()];
+				const tri_t* tris[2] = { &quad.first, &quad.second };
+
+				for (uint32_t i = 0; i < 2; i++)
+				{
+					const tri_t& tri = *tris[i];
+					if (intersect_triangle(ray, verts[tri.a].pos, verts[tri.b].pos, verts[tri.c].pos, closest, hit.u, hit.v))
+					{
+						hit.element_id = node.element_id();
+						hit.triangle = i;
+						hit.t = closest;
+					}
+				}
+
+				continue;
+			}
+
+			float t_left = slab_test(ray, bvh[node.left()].aabb(), closest);
+			float t_right = slab_test(ray, bvh[node.right()].aabb(), closest);
+
+			// Push the far child first so the near one is visited next
+			pending_t near_child = { node.left(), t_left };
+			pending_t far_child = { node.right(), t_right };
+			if (t_right < t_left)
+				std::swap(near_child, far_child);
+
+			if (far_child.t_enter != INFINITY)
+				stack.push(far_child);
+			if (near_child.t_enter != INFINITY)
+				stack.push(near_child);
+		}
+
+		return hit.hit();
+	}
+
+	bool bounding_volume_hierarchy_t::segment_cast(const float3& segment_start, const float3& segment_end, const quad_t* quads, const pos_norm_uv_vertex* verts, bvh_ray_hit_t& hit)const
+	{
+		return raycast(segment_start, segment_end - segment_start, 1.0f, quads, verts, hit);
+	}
+
+	void bounding_volume_hierarchy_t::query_frustum(const frustum_t& frustum, std::vector<int>& out)const
+	{
+		if (bvh.empty())
+			return;
+
+		const uint32_t all_planes = (1u << 6) - 1;
+
+		// Pending nodes, along with the planes they still have to be tested against
+		struct pending_t
+		{
+			uint32_t index;
+			uint32_t plane_mask;
+		};
+
+		bvh_stack_t<pending_t> stack;
+		stack.push({ 0, all_planes });
+
+		while (!stack.empty())
+		{
+			pending_t pending = stack.pop();
+			const bvh_node_t& node = bvh[pending.index];
+
+			bool culled = false;
+			for (uint32_t i = 0; i < 6 && !culled; i++)
+			{
+				if (!(pending.plane_mask & (1u << i)))
+					continue;
+
+				int side = classify_aabb_to_plane(node.aabb(), frustum[i]);
+				if (side < 0)
+					culled = true;
+				else if (side > 0)
+					pending.plane_mask &= ~(1u << i);
+			}
+
+			if (culled)
+				continue;
+
+			if (node.is_leaf())
+			{
+				out.push_back(node.element_id());
+				continue;
+			}
+
+			// Children inherit the mask, so a fully inside subtree is emitted without tests
+			stack.push({ node.right(), pending.plane_mask });
+			stack.push({ node.left(), pending.plane_mask });
+		}
+	}
+
+	bool bounding_volume_hierarchy_t::closest_point(const float3& point, const quad_t* quads, const pos_norm_uv_vertex* verts, bvh_closest_point_t& result, float max_distance)const
+	{
+		result = bvh_closest_point_t();
+		result.distance_squared = max_distance * max_distance;
+
+		if (bvh.empty())
+			return false;
+
+		// Min-heap of pending nodes, reused between calls
+		thread_local std::vector<nearest_t> heap;
+		heap.clear();
+		heap.push_back({ distance_squared(point, bvh[0].aabb()), 0 });
+
+		while (!heap.empty())
+		{
+			std::pop_heap(heap.begin(), heap.end(), std::greater<nearest_t>());
+			nearest_t pending = heap.back();
+			heap.pop_back();
+
+			// Everything left is at least this far away
+			if (pending.distance_squared > result.distance_squared)
+				break;
+
+			const bvh_node_t& node = bvh[pending.index];
+
+			if (node.is_leaf())
+			{
+				const quad_t& quad = quads[node.element_id()];
+				const tri_t* tris[2] = { &quad.first, &quad.second };
+
+				for (const tri_t* tri : tris)
+				{
+					float3 closest = closest_point_on_triangle(point, verts[tri->a].pos, verts[tri->b].pos, verts[tri->c].pos);
+					float3 offset = closest - point;
+					float d = offset.dot(offset, offset);
+
+					if (d <= result.distance_squared)
+					{
+						result.element_id = node.element_id();
+						result.point = closest;
+						result.distance_squared = d;
+					}
+				}
+
+				continue;
+			}
+
+			for (uint32_t child : { node.left(), node.right() })
+			{
+				float d = distance_squared(point, bvh[child].aabb());
+				if (d <= result.distance_squared)
+				{
+					heap.push_back({ d, child });
+					std::push_heap(heap.begin(), heap.end(), std::greater<nearest_t>());
+				}
+			}
+		}
+
+		return result.found();
+	}
+
+	void bounding_volume_hierarchy_t::k_nearest(const float3& point, uint32_t k, std::vector<uint32_t>& element_ids)const
+	{
+		element_ids.clear();
+
+		if (bvh.empty() || k == 0)
+			return;
+
+		// Min-heap of pending nodes, and max-heap of the k best elements so far
+		thread_local std::vector<nearest_t> heap;
+		thread_local std::vector<nearest_t> best;
+		heap.clear();
+		best.clear();
+
+		heap.push_back({ distance_squared(point, bvh[0].aabb()), 0 });
+
+		while (!heap.empty())
+		{
+			std::pop_heap(heap.begin(), heap.end(), std::greater<nearest_t>());
+			nearest_t pending = heap.back();
+			heap.pop_back();
+
+			// Once k elements are found, only closer nodes can improve the result
+			if (best.size() == k && pending.distance_squared >= best.front().distance_squared)
+				break;
+
+			const bvh_node_t& node = bvh[pending.index];
+
+			if (node.is_leaf())
+			{
+				if (best.size() == k)
+				{
+					std::pop_heap(best.begin(), best.end());
+					best.pop_back();
+				}
+
+				best.push_back({ pending.distance_squared, node.element_id() });
+				std::push_heap(best.begin(), best.end());
+				continue;
+			}
+
+			for (uint32_t child : { node.left(), node.right() })
+			{
+				float d = distance_squared(point, bvh[child].aabb());
+				if (best.size() < k || d < best.front().distance_squared)
+				{
+					heap.push_back({ d, child });
+					std::push_heap(heap.begin(), heap.end(), std::greater<nearest_t>());
+				}
+			}
+		}
+
+		std::sort_heap(best.begin(), best.end());
+
+		element_ids.reserve(best.size());
+		for (const nearest_t& nearest : best)
+			element_ids.push_back(nearest.index);
+	}
+
+	void bounding_volume_hierarchy_t::query_batch(const aabb_t* targets, uint32_t count, bvh_batch_result_t& results)const
+	{
+		results.offsets.assign(count + 1, 0);
+		results.element_ids.clear();
+
+		if (bvh.empty() || count == 0)
+			return;
+
+		// Hits are collected as (target, element id) pairs, then grouped by target
+		struct hit_t
+		{
+			uint32_t target;
+			uint32_t element_id;
+		};
+
+		thread_local std::vector<hit_t> hits;
+		hits.clear();
+
+		// Pending nodes, along with the targets that reached them
+		struct pending_t
+		{
+			uint32_t index;
+			uint64_t mask;
+		};
+
+		static_assert(BVH_PACKET_SIZE <= 64 && BVH_PACKET_SIZE % 4 == 0, "packet masks are 64-bit and tested in groups of 4");
+
+		for (uint32_t first = 0; first < count; first += BVH_PACKET_SIZE)
+		{
+			uint32_t packet_size = std::min(BVH_PACKET_SIZE, count - first);
+
+			// Targets as min/max SoA, unused slots never collide
+			alignas(16) float min_x[BVH_PACKET_SIZE], min_y[BVH_PACKET_SIZE], min_z[BVH_PACKET_SIZE];
+			alignas(16) float max_x[BVH_PACKET_SIZE], max_y[BVH_PACKET_SIZE], max_z[BVH_PACKET_SIZE];
+
+			for (uint32_t i = 0; i < BVH_PACKET_SIZE; i++)
+			{
+				if (i < packet_size)
+				{
+					const aabb_t& target = targets[first + i];
+					float3 target_min = target.center - target.extents;
+					float3 target_max = target.center + target.extents;
+
+					min_x[i] = target_min.x; min_y[i] = target_min.y; min_z[i] = target_min.z;
+					max_x[i] = target_max.x; max_y[i] = target_max.y; max_z[i] = target_max.z;
+				}
+				else
+				{
+					min_x[i] = min_y[i] = min_z[i] = INFINITY;
+					max_x[i] = max_y[i] = max_z[i] = -INFINITY;
+				}
+			}
+
+			bvh_stack_t<pending_t> stack;
+			stack.push({ 0, packet_size == 64 ? ~0ull : (1ull << packet_size) - 1 });
+
+			while (!stack.empty())
+			{
+				pending_t pending = stack.pop();
+				const bvh_node_t& node = bvh[pending.index];
+
+				float3 node_min = node.aabb().center - node.aabb().extents;
+				float3 node_max = node.aabb().center + node.aabb().extents;
+
+				const __m128 node_min_x = _mm_set1_ps(node_min.x);
+				const __m128 node_min_y = _mm_set1_ps(node_min.y);
+				const __m128 node_min_z = _mm_set1_ps(node_min.z);
+				const __m128 node_max_x = _mm_set1_ps(node_max.x);
+				const __m128 node_max_y = _mm_set1_ps(node_max.y);
+				const __m128 node_max_z = _mm_set1_ps(node_max.z);
+
+				// Same comparisons as aabbs_collide, for the active groups of 4 targets
+				uint64_t mask = 0;
+				for (uint32_t shift = 0; shift < BVH_PACKET_SIZE && (pending.mask >> shift); shift += 4)
+				{
+					if (!((pending.mask >> shift) & 0xF))
+						continue;
+
+					__m128 hit = _mm_and_ps(
+						_mm_and_ps(
+							_mm_cmplt_ps(node_min_x, _mm_load_ps(max_x + shift)),
+							_mm_cmpgt_ps(node_max_x, _mm_load_ps(min_x + shift))),
+						_mm_and_ps(
+							_mm_and_ps(
+								_mm_cmplt_ps(node_min_y, _mm_load_ps(max_y + shift)),
+								_mm_cmpgt_ps(node_max_y, _mm_load_ps(min_y + shift))),
+							_mm_and_ps(
+								_mm_cmplt_ps(node_min_z, _mm_load_ps(max_z + shift)),
+								_mm_cmpgt_ps(node_max_z, _mm_load_ps(min_z + shift)))));
+
+					mask |= (uint64_t)_mm_movemask_ps(hit) << shift;
+				}
+
+				mask &= pending.mask;
+				if (!mask)
+					continue;
+
+				if (node.is_branch())
+				{
+					stack.push({ node.right(), mask });
+					stack.push({ node.left(), mask });
+					continue;
+				}
+
+				for (uint32_t i = 0; i < BVH_PACKET_SIZE && (mask >> i); i++)
+				{
+					if (mask & (1ull << i))
+						hits.push_back({ first + i, node.element_id() });
+				}
+			}
+		}
+
+		// Counting sort by target, which keeps each target's hits in traversal order
+		for (const hit_t& hit : hits)
+			results.offsets[hit.target + 1]++;
+
+		for (uint32_t i = 0; i < count; i++)
+			results.offsets[i + 1] += results.offsets[i];
+
+		results.element_ids.resize(hits.size());
+
+		thread_local std::vector<uint32_t> cursors;
+		cursors.assign(results.offsets.begin(), results.offsets.end() - 1);
+
+		for (const hit_t& hit : hits)
+			results.element_ids[cursors[hit.target]++] = hit.element_id;
+	}
+
+	void find_overlapping_pairs(const bvh_t& a, const bvh_t& b, std::vector<bvh_pair_t>& pairs)
+	{
+		pairs.clear();
+
+		if (a.bvh.empty() || b.bvh.empty())
+			return;
+
+		// Pending node pairs, one node from each tree
+		thread_local std::vector<bvh_pair_t> stack;
+		stack.clear();
+		stack.push_back({ 0, 0 });
+
+		while (!stack.empty())
+		{
+			bvh_pair_t pending = stack.back();
+			stack.pop_back();
+
+			const bvh_node_t& node_a = a.bvh[pending.first];
+			const bvh_node_t& node_b = b.bvh[pending.second];
+
+			if (!aabbs_collide(node_a.aabb(), node_b.aabb()))
+				continue;
+
+			if (node_a.is_leaf() && node_b.is_leaf())
+			{
+				pairs.push_back({ node_a.element_id(), node_b.element_id() });
+				continue;
+			}
+
+			// Open the larger node, so both sides shrink at a similar rate
+			bool open_a = node_b.is_leaf() || (node_a.is_branch() && surface_area(node_a.aabb()) >= surface_area(node_b.aabb()));
+
+			if (open_a)
+			{
+				stack.push_back({ node_a.right(), pending.second });
+				stack.push_back({ node_a.left(), pending.second });
+			}
+			else
+			{
+				stack.push_back({ pending.first, node_b.right() });
+				stack.push_back({ pending.first, node_b.left() });
+			}
+		}
+	}
+
+	void find_overlapping_pairs(const bvh_t& tree, std::vector<bvh_pair_t>& pairs)
+	{
+		pairs.clear();
+
+		if (tree.bvh.empty())
+			return;
+
+		// Pending node pairs. A node paired with itself stands for every pair inside its subtree.
+		thread_local std::vector<bvh_pair_t> stack;
+		stack.clear();
+		stack.push_back({ 0, 0 });
+
+		while (!stack.empty())
+		{
+			bvh_pair_t pending = stack.back();
+			stack.pop_back();
+
+			const bvh_node_t& node_a = tree.bvh[pending.first];
+			const bvh_node_t& node_b = tree.bvh[pending.second];
+
+			if (pending.first == pending.second)
+			{
+				if (node_a.is_leaf())
+					continue;
+
+				stack.push_back({ node_a.left(), node_a.right() });
+				stack.push_back({ node_a.right(), node_a.right() });
+				stack.push_back({ node_a.left(), node_a.left() });
+				continue;
+			}
+
+			if (!aabbs_collide(node_a.aabb(), node_b.aabb()))
+				continue;
+
+			if (node_a.is_leaf() && node_b.is_leaf())
+			{
+				uint32_t first = node_a.element_id();
+				uint32_t second = node_b.element_id();
+				pairs.push_back({ std::min(first, second), std::max(first, second) });
+				continue;
+			}
+
+			// The two nodes are disjoint subtrees, so this is the same descent as above
+			bool open_a = node_b.is_leaf() || (node_a.is_branch() && surface_area(node_a.aabb()) >= surface_area(node_b.aabb()));
+
+			if (open_a)
+			{
+				stack.push_back({ node_a.right(), pending.second });
+				stack.push_back({ node_a.left(), pending.second });
+			}
+			else
+			{
+				stack.push_back({ pending.first, node_b.right() });
+				stack.push_back({ pending.first, node_b.left() });
+			}
+		}
+	}
+
+	void bvh_query_cache_t::traverse_tree(const bvh_t& tree, const aabb_t& target, std::vector<int>& quads_to_draw, const end::grid_colors& colors, bvh_query_stats_t* stats)
+	{
+		if (tree.bvh.empty())
+			return;
+
+		// The tree may have been rebuilt since the last query
+		if (start >= tree.bvh.size())
+			start = 0;
+
+		// Climb until the start node collides with the target, or the root is reached
+		while (!tree.bvh[start].is_root() && !aabbs_collide(tree.bvh[start].aabb(), target))
+			start = tree.bvh[start].parent();
+
+		// Then go down while one child contains the target, or is the only one it collides with
+		while (tree.bvh[start].is_branch())
+		{
+			const bvh_node_t& node = tree.bvh[start];
+			const aabb_t& left = tree.bvh[node.left()].aabb();
+			const aabb_t& right = tree.bvh[node.right()].aabb();
+			bool left_collides = aabbs_collide(left, target);
+			bool right_collides = aabbs_collide(right, target);
+
+			if (aabb_contains(left, target) || (left_collides && !right_collides))
+				start = node.left();
+			else if (aabb_contains(right, target) || (right_collides && !left_collides))
+				start = node.right();
+			else
+				break;
+		}
+
+		tree.traverse_tree(start, target, quads_to_draw, colors, stats);
+
+		// Everything else is under a sibling of the start node or of one of its ancestors.
+		// If any of them collides, the next query starts above it.
+		uint32_t next_start = start;
+		for (uint32_t child = start; !tree.bvh[child].is_root(); child = tree.bvh[child].parent())
+		{
+			uint32_t parent_index = tree.bvh[child].parent();
+			const bvh_node_t& parent = tree.bvh[parent_index];
+			uint32_t sibling = parent.left() == child ? parent.right() : parent.left();
+
+			if (!aabbs_collide(tree.bvh[sibling].aabb(), target))
+			{
+				if (stats)
+					stats->aabb_tests++;
+				continue;
+			}
+
+			tree.traverse_tree(sibling, target, quads_to_draw, colors, stats);
+			next_start = parent_index;
+		}
+
+		start = next_start;
+	}
+}
\ No newline at end of file
@@ -57,6 +57,10 @@ namespace end
 
 		void add_line(float3 point_a, float3 point_b, float4 color_a, float4 color_b)
 		{
+			// Drop lines once the buffer is full rather than writing past it
+			if (line_vert_count + 2 > MAX_LINE_VERTS)
+				return;
+
 			line_verts[line_vert_count].pos = point_a;
 			line_verts[line_vert_count++].color = color_a;
 
@@ -6,8 +6,10 @@
 #include "emitter.h"
 #include <vector>
 #include "bvh.h"
+#include "bvh_file.h"
 #include <algorithm> 
 #include <cmath> 
+#include <cfloat>
 
 
 namespace
@@ -38,6 +40,57 @@ namespace
 	// Constants
 	const end::float3 Gravity = end::float3(0, -9.8f, 0);
 	const end::float3 ParticleSize = end::float3(1.0f, 1.0f, 1.0f);
+
+	// Reorders the terrain's 6-vertex quad blocks along a Z-order curve through their centers,
+	// so quads that are close together in the world are also close together in memory
+	void sort_terrain_quads_by_morton(std::vector<end::pos_norm_uv_vertex>& verts)
+	{
+		size_t quad_count = verts.size() / 6;
+		if (quad_count < 2)
+			return;
+
+		std::vector<end::float3> centers(quad_count);
+		end::float3 min_center = { FLT_MAX, FLT_MAX, FLT_MAX };
+		end::float3 max_center = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+		for (size_t i = 0; i < quad_count; i++)
+		{
+			end::float3 center = { 0.0f, 0.0f, 0.0f };
+			for (size_t v = 0; v < 6; v++)
+				center += verts[i * 6 + v].pos;
+			centers[i] = center / 6.0f;
+
+			for (int axis = 0; axis < 3; axis++)
+			{
+				min_center[axis] = std::min(min_center[axis], centers[i][axis]);
+				max_center[axis] = std::max(max_center[axis], centers[i][axis]);
+			}
+		}
+
+		// Map the centers onto a 1024^3 grid of cubes, so a flat terrain's height doesn't
+		// get as many code bits as its width
+		end::float3 size = max_center - min_center;
+		float largest_size = std::max(size.x, std::max(size.y, size.z));
+		float scale = largest_size > 0.0f ? 1023.0f / largest_size : 0.0f;
+
+		std::vector<uint32_t> codes(quad_count);
+		std::vector<uint32_t> order(quad_count);
+		for (size_t i = 0; i < quad_count; i++)
+		{
+			end::float3 cell = (centers[i] - min_center) * scale;
+			codes[i] = end::morton_code_30((uint32_t)cell.x, (uint32_t)cell.y, (uint32_t)cell.z);
+			order[i] = (uint32_t)i;
+		}
+
+		std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return codes[a] < codes[b]; });
+
+		// Vertices past the last whole quad stay at the end
+		std::vector<end::pos_norm_uv_vertex> sorted_verts(verts.size());
+		for (size_t i = 0; i < quad_count; i++)
+			std::copy_n(verts.begin() + order[i] * 6, 6, sorted_verts.begin() + i * 6);
+		std::copy(verts.begin() + quad_count * 6, verts.end(), sorted_verts.begin() + quad_count * 6);
+
+		verts.swap(sorted_verts);
+	}
 }
 
 namespace end
@@ -224,6 +277,9 @@ namespace end
 		aabbs.push_back({ float3(-2, 1.1f, 7), float3(1.2f, 1.1f, 2) });
 		aabbs.push_back({ float3(4, 0.5f, -2), float3(1.2f, 0.5f, 1.3f) });
 
+		for (const aabb_t& aabb : aabbs)
+			aabbs_soa.push_back(aabb);
+
 		initializers[Initializers::TEST_AABBS] = true;
 	}
 
@@ -233,6 +289,10 @@ namespace end
 		initializers[Initializers::TERRAIN_AABBS] = true;
 		character_matrix[3][1] = 0;
 
+		// Quads are built from consecutive vertex blocks, so this also orders terrain_quads
+		// and their element ids, and query results land in nearby memory
+		sort_terrain_quads_by_morton(*terrain_verts);
+
 		unsigned int terrain_vert_count = terrain_verts->size() / 6;
 		terrain_quads.reserve(terrain_vert_count);
 
@@ -247,11 +307,11 @@ namespace end
 			++count;
 		}
 
-		// Shuffle quads 
-		std::random_shuffle(terrain_quads.begin(),
-			terrain_quads.end());
-
-		//Insert each quad's aabb into tree 
+		// Calculate each quad's aabb
+		std::vector<aabb_t> quad_aabbs;
+		std::vector<uint32_t> quad_ids;
+		quad_aabbs.reserve(terrain_quads.size());
+		quad_ids.reserve(terrain_quads.size());
 		for (int i = 0; i < terrain_quads.size(); i++)
 		{
 			quad_t quad = terrain_quads[i];
@@ -295,9 +355,29 @@ namespace end
 
 			aabb_t new_aabb = { new_center, new_extents };
 
-			bvh_tree.insert(new_aabb, i);
+			quad_aabbs.push_back(new_aabb);
+			quad_ids.push_back(i);
+		}
+
+		// Reuse the tree cached from a previous run while the terrain hasn't changed,
+		// otherwise build it in one pass (SAH splits don't depend on insertion order) and cache it
+		uint64_t terrain_checksum = fnv1a_64(terrain_verts->data(), terrain_verts->size() * sizeof(pos_norm_uv_vertex));
+		mapped_bvh_t cached_tree;
+		if (cached_tree.open("terrain.bvh", terrain_checksum))
+		{
+			bvh_tree.bvh.assign(cached_tree.nodes(), cached_tree.nodes() + cached_tree.node_count());
+			bvh_tree.element_leaves.assign(cached_tree.element_leaves(), cached_tree.element_leaves() + cached_tree.element_count());
+		}
+		else
+		{
+			bvh_tree.build_parallel(quad_aabbs.data(), quad_ids.data(), (uint32_t)quad_aabbs.size());
+			save_bvh("terrain.bvh", bvh_tree, terrain_checksum);
 		}
 
+		// compute_stats walks the whole tree, so only pay for it when asked to
+		if (log_bvh_stats)
+			print_bvh_stats(std::cout, bvh_tree.compute_stats());
+
 		// use grid for color magic!
 		debug_grid_colors.increments[0] = { 0.5f, 0.6f, 0.4f, 1.0f };
 		debug_grid_colors.increments[1] = { 0.5f, 0.5f, 0.5f, 1.0f };
@@ -317,7 +397,11 @@ namespace end
 	{
 		quads_to_draw.clear();
 		debug_grid_colors.update();
-		bvh_tree.traverse_tree(0, character_aabb, quads_to_draw, debug_grid_colors);
+		terrain_query_stats = {};
+		character_query_cache.traverse_tree(bvh_tree, character_aabb, quads_to_draw, debug_grid_colors, &terrain_query_stats);
+
+		if (log_bvh_stats)
+			print_bvh_stats(std::cout, terrain_query_stats);
 
 		static const float4 wireframe_color = { 1.0f, 1.0f, 1.0f, 1.0f };
 		for (int i = 0; i < quads_to_draw.size(); i++)
@@ -553,9 +637,18 @@ namespace end
 
 	void dev_app_t::update_aabbs()
 	{
-		for (auto aabb = aabbs.begin(); aabb != aabbs.end(); aabb++)
+		cull_view(character_view, character_frustum, aabbs_soa);
+
+		// visible_set is in ascending order, so it can be walked alongside the aabbs
+		const std::vector<uint32_t>& visible_set = character_view.visible_set;
+		size_t next_visible = 0;
+		for (uint32_t i = 0; i < aabbs.size(); i++)
 		{
-			debug_renderer::draw_aabb(*aabb, aabb_to_frustum(*aabb, character_frustum));
+			bool visible = next_visible < visible_set.size() && visible_set[next_visible] == i;
+			if (visible)
+				next_visible++;
+
+			debug_renderer::draw_aabb(aabbs[i], visible);
 		}
 	}
 
@@ -747,6 +840,15 @@ namespace end
 	{
 		delta_time = calc_delta_time();
 
+		// Toggle bvh stats logging on the key press, not every frame it's held
+		if (keyStates[D_VK_B] && !bvh_stats_key_down)
+		{
+			log_bvh_stats = !log_bvh_stats;
+			if (log_bvh_stats && initializers[Initializers::TERRAIN_AABBS])
+				print_bvh_stats(std::cout, bvh_tree.compute_stats());
+		}
+		bvh_stats_key_down = keyStates[D_VK_B];
+
 		// Update Grid
 		if (initializers[Initializers::GRID])
 		{
@@ -18,6 +18,7 @@
 #define D_VK_D				0x44
 #define D_VK_W				0x57
 #define D_VK_S				0x53
+#define D_VK_B				0x42
 
 #define D_VK_RMB			0x1
 #define D_VK_LMB			0x0
@@ -48,6 +49,7 @@ namespace end
 		camera_properties character_cam_props;
 
 		std::vector<aabb_t> aabbs;
+		aabb_soa_t aabbs_soa;
 		aabb_t character_aabb;
 
 		float movement_speed = 4;
@@ -62,6 +64,15 @@ namespace end
 		std::vector<int> quads_to_draw;
 		bvh_t bvh_tree;
 
+		// Start node of the character's terrain query, kept between frames
+		bvh_query_cache_t character_query_cache;
+
+		// Work done by this frame's terrain query, printed every frame if log_bvh_stats is set.
+		// B toggles log_bvh_stats, and turning it on also prints the tree's stats once.
+		bvh_query_stats_t terrain_query_stats;
+		bool log_bvh_stats = false;
+		bool bvh_stats_key_down = false;
+
 		void update();
 
 		dev_app_t();
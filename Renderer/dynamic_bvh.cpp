@@ -0,0 +1,261 @@
+#include "dynamic_bvh.h"
+#include <algorithm>
+
+namespace
+{
+	using end::aabb_t;
+
+	float union_area(const aabb_t& a, const aabb_t& b)
+	{
+		return end::surface_area(end::encapsulate(a, b));
+	}
+}
+
+namespace end
+{
+	uint32_t dynamic_bvh_t::insert(const aabb_t& aabb, uint32_t element_id)
+	{
+		uint32_t leaf = allocate_node();
+		dynamic_bvh_node_t& node = nodes[leaf];
+		node.aabb = { aabb.center, aabb.extents + float3(margin, margin, margin) };
+		node.element_id = element_id;
+		node.height = 0;
+
+		insert_leaf(leaf);
+		leaf_count++;
+
+		return leaf;
+	}
+
+	void dynamic_bvh_t::remove(uint32_t proxy_id)
+	{
+		assert(proxy_id < nodes.size() && nodes[proxy_id].is_leaf() && nodes[proxy_id].height == 0);
+
+		remove_leaf(proxy_id);
+		free_node(proxy_id);
+		leaf_count--;
+	}
+
+	bool dynamic_bvh_t::move(uint32_t proxy_id, const aabb_t& aabb)
+	{
+		assert(proxy_id < nodes.size() && nodes[proxy_id].is_leaf() && nodes[proxy_id].height == 0);
+
+		if (aabb_contains(nodes[proxy_id].aabb, aabb))
+			return false;
+
+		remove_leaf(proxy_id);
+		nodes[proxy_id].aabb = { aabb.center, aabb.extents + float3(margin, margin, margin) };
+		insert_leaf(proxy_id);
+
+		return true;
+	}
+
+	uint32_t dynamic_bvh_t::allocate_node()
+	{
+		if (free_list == UINT32_MAX)
+		{
+			nodes.emplace_back();
+			return (uint32_t)nodes.size() - 1;
+		}
+
+		uint32_t index = free_list;
+		free_list = nodes[index].parent_or_next;
+		nodes[index] = dynamic_bvh_node_t();
+
+		return index;
+	}
+
+	void dynamic_bvh_t::free_node(uint32_t index)
+	{
+		nodes[index] = dynamic_bvh_node_t();
+		nodes[index].parent_or_next = free_list;
+		free_list = index;
+	}
+
+	void dynamic_bvh_t::insert_leaf(uint32_t leaf)
+	{
+		if (root_index == UINT32_MAX)
+		{
+			root_index = leaf;
+			nodes[leaf].parent_or_next = UINT32_MAX;
+			return;
+		}
+
+		// Find the sibling with the lowest SAH cost.
+		// Going deeper costs the growth of every branch on the way down (the inheritance cost),
+		// so stop once neither child can beat pairing with the current node.
+		const aabb_t leaf_aabb = nodes[leaf].aabb;
+		uint32_t sibling = root_index;
+
+		while (!nodes[sibling].is_leaf())
+		{
+			const dynamic_bvh_node_t& node = nodes[sibling];
+
+			float area = surface_area(node.aabb);
+			float combined_area = union_area(node.aabb, leaf_aabb);
+
+			float cost = 2.0f * combined_area;
+			float inheritance_cost = 2.0f * (combined_area - area);
+
+			auto descend_cost = [&](uint32_t child)
+			{
+				const dynamic_bvh_node_t& child_node = nodes[child];
+				float child_cost = union_area(child_node.aabb, leaf_aabb);
+				if (!child_node.is_leaf())
+					child_cost -= surface_area(child_node.aabb);
+
+				return child_cost + inheritance_cost;
+			};
+
+			float left_cost = descend_cost(node.left);
+			float right_cost = descend_cost(node.right);
+
+			if (cost < left_cost && cost < right_cost)
+				break;
+
+			sibling = left_cost < right_cost ? node.left : node.right;
+		}
+
+		// Put a new branch where the sibling was, with the sibling and the leaf under it
+		uint32_t old_parent = nodes[sibling].parent_or_next;
+		uint32_t new_parent = allocate_node();
+
+		dynamic_bvh_node_t& branch = nodes[new_parent];
+		branch.parent_or_next = old_parent;
+		branch.aabb = encapsulate(leaf_aabb, nodes[sibling].aabb);
+		branch.height = nodes[sibling].height + 1;
+		branch.left = sibling;
+		branch.right = leaf;
+
+		nodes[sibling].parent_or_next = new_parent;
+		nodes[leaf].parent_or_next = new_parent;
+
+		if (old_parent == UINT32_MAX)
+		{
+			root_index = new_parent;
+		}
+		else
+		{
+			dynamic_bvh_node_t& parent = nodes[old_parent];
+			if (parent.left == sibling)
+				parent.left = new_parent;
+			else
+				parent.right = new_parent;
+		}
+
+		refit_ancestors(old_parent);
+	}
+
+	void dynamic_bvh_t::remove_leaf(uint32_t leaf)
+	{
+		if (leaf == root_index)
+		{
+			root_index = UINT32_MAX;
+			return;
+		}
+
+		// The parent branch goes away, and the sibling takes its place
+		uint32_t parent = nodes[leaf].parent_or_next;
+		uint32_t grandparent = nodes[parent].parent_or_next;
+		uint32_t sibling = nodes[parent].left == leaf ? nodes[parent].right : nodes[parent].left;
+
+		free_node(parent);
+		nodes[sibling].parent_or_next = grandparent;
+		nodes[leaf].parent_or_next = UINT32_MAX;
+
+		if (grandparent == UINT32_MAX)
+		{
+			root_index = sibling;
+			return;
+		}
+
+		dynamic_bvh_node_t& node = nodes[grandparent];
+		if (node.left == parent)
+			node.left = sibling;
+		else
+			node.right = sibling;
+
+		refit_ancestors(grandparent);
+	}
+
+	void dynamic_bvh_t::refit_ancestors(uint32_t index)
+	{
+		while (index != UINT32_MAX)
+		{
+			dynamic_bvh_node_t& node = nodes[index];
+			node.aabb = encapsulate(nodes[node.left].aabb, nodes[node.right].aabb);
+			node.height = 1 + std::max(nodes[node.left].height, nodes[node.right].height);
+
+			rotate(index);
+
+			index = nodes[index].parent_or_next;
+		}
+	}
+
+	void dynamic_bvh_t::rotate(uint32_t index)
+	{
+		// Tries swapping one child of 'index' with one of its grandchildren on the other side.
+		// The swap only changes the box of the child that gains a grandchild, so the best
+		// rotation is the one that shrinks that box the most (Kopta et al. tree rotations).
+		dynamic_bvh_node_t& a = nodes[index];
+		if (a.height < 2)
+			return;
+
+		uint32_t b = a.left;
+		uint32_t c = a.right;
+
+		// Candidate swaps: 'child' trades places with 'grandchild', which sits under 'other'
+		struct rotation_t
+		{
+			uint32_t child;
+			uint32_t other;
+			uint32_t grandchild;
+			float area_saved;
+		};
+
+		rotation_t best = { UINT32_MAX, UINT32_MAX, UINT32_MAX, 0.0f };
+
+		auto consider = [&](uint32_t child, uint32_t other)
+		{
+			const dynamic_bvh_node_t& other_node = nodes[other];
+			if (other_node.is_leaf())
+				return;
+
+			float area = surface_area(other_node.aabb);
+
+			// Swapping with one grandchild leaves 'child' paired with the other one
+			float left_saved = area - union_area(nodes[child].aabb, nodes[other_node.right].aabb);
+			float right_saved = area - union_area(nodes[child].aabb, nodes[other_node.left].aabb);
+
+			if (left_saved > best.area_saved)
+				best = { child, other, other_node.left, left_saved };
+			if (right_saved > best.area_saved)
+				best = { child, other, other_node.right, right_saved };
+		};
+
+		consider(b, c);
+		consider(c, b);
+
+		if (best.child == UINT32_MAX)
+			return;
+
+		// Swap 'child' (under index) with 'grandchild' (under other)
+		dynamic_bvh_node_t& other = nodes[best.other];
+		if (a.left == best.child)
+			a.left = best.grandchild;
+		else
+			a.right = best.grandchild;
+
+		if (other.left == best.grandchild)
+			other.left = best.child;
+		else
+			other.right = best.child;
+
+		nodes[best.grandchild].parent_or_next = index;
+		nodes[best.child].parent_or_next = best.other;
+
+		other.aabb = encapsulate(nodes[other.left].aabb, nodes[other.right].aabb);
+		other.height = 1 + std::max(nodes[other.left].height, nodes[other.right].height);
+		a.height = 1 + std::max(nodes[a.left].height, nodes[a.right].height);
+	}
+}
\ No newline at end of file
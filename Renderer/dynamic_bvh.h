@@ -0,0 +1,136 @@
+#pragma once
+#include <cstdint>
+#include <cassert>
+#include <vector>
+
+#include "math_types.h"
+#include "bvh.h"
+
+namespace end
+{
+	// dynamic_bvh_node_t
+	//
+	// Node of a dynamic_bvh_t.
+	// Leaves keep their index for as long as they're in the tree, it doubles as the proxy id.
+	struct dynamic_bvh_node_t
+	{
+		// Fat aabb for leaves, union of the children for branches
+		aabb_t aabb;
+
+		// Parent index, or the next free node while this node is unused
+		uint32_t parent_or_next = UINT32_MAX;
+
+		// Child indices, UINT32_MAX for leaves
+		uint32_t left = UINT32_MAX;
+		uint32_t right = UINT32_MAX;
+
+		// Only used by leaves
+		uint32_t element_id = UINT32_MAX;
+
+		// 0 for leaves, -1 while unused
+		int32_t height = -1;
+
+		inline bool is_leaf()const { return left == UINT32_MAX; }
+	};
+
+	// dynamic_bvh_t
+	//
+	// Incrementally updated aabb tree for moving, spawning and despawning objects
+	// (in the style of Box2D's b2DynamicTree and Bullet's dbvt).
+	//
+	// Leaves store a "fat" aabb grown by 'margin', so small moves don't touch the tree.
+	// Inserts pick the sibling with the lowest surface area heuristic (SAH) cost, and
+	// every branch on the way back up is offered a local rotation that lowers it.
+	class dynamic_bvh_t
+	{
+	public:
+		dynamic_bvh_t(float margin = 0.1f) : margin{ margin } {}
+
+		// Adds an aabb/element_id pair and returns its proxy id.
+		// The proxy id stays valid until remove() is called with it.
+		uint32_t insert(const aabb_t& aabb, uint32_t element_id);
+
+		// Removes a proxy from the tree
+		void remove(uint32_t proxy_id);
+
+		// Updates a proxy's aabb.
+		// Returns true if it left its fat aabb and had to be reinserted.
+		bool move(uint32_t proxy_id, const aabb_t& aabb);
+
+		inline const aabb_t& fat_aabb(uint32_t proxy_id)const { return nodes[proxy_id].aabb; }
+
+		inline uint32_t element_id(uint32_t proxy_id)const { return nodes[proxy_id].element_id; }
+
+		inline uint32_t root()const { return root_index; }
+
+		inline uint32_t height()const { return root_index == UINT32_MAX ? 0 : nodes[root_index].height; }
+
+		inline size_t proxy_count()const { return leaf_count; }
+
+		inline const dynamic_bvh_node_t& node_at(uint32_t i)const { return nodes[i]; }
+
+		// Number of node slots, including unused ones
+		inline size_t node_capacity()const { return nodes.size(); }
+
+		// Calls visitor(element_id) for every proxy whose fat aabb collides with 'target'.
+		// The visitor returns false to stop the query early.
+		// Returns false if the query was stopped by the visitor.
+		template<typename Visitor>
+		bool query(const aabb_t& target, Visitor&& visitor)const;
+
+	private:
+		uint32_t allocate_node();
+
+		void free_node(uint32_t index);
+
+		void insert_leaf(uint32_t leaf);
+
+		void remove_leaf(uint32_t leaf);
+
+		// Refits the branches from 'index' up to the root, rotating each one
+		void refit_ancestors(uint32_t index);
+
+		void rotate(uint32_t index);
+
+		std::vector<dynamic_bvh_node_t> nodes;
+
+		uint32_t root_index = UINT32_MAX;
+
+		uint32_t free_list = UINT32_MAX;
+
+		size_t leaf_count = 0;
+
+		float margin;
+	};
+
+	template<typename Visitor>
+	bool dynamic_bvh_t::query(const aabb_t& target, Visitor&& visitor)const
+	{
+		if (root_index == UINT32_MAX)
+			return true;
+
+		bvh_stack_t<uint32_t> stack;
+		stack.push(root_index);
+
+		while (!stack.empty())
+		{
+			const dynamic_bvh_node_t& node = nodes[stack.pop()];
+
+			if (!aabbs_collide(node.aabb, target))
+				continue;
+
+			if (node.is_leaf())
+			{
+				if (!visitor(node.element_id))
+					return false;
+
+				continue;
+			}
+
+			stack.push(node.right);
+			stack.push(node.left);
+		}
+
+		return true;
+	}
+}
\ No newline at end of file
@@ -0,0 +1,199 @@
+#include "flat_bvh.h"
+#include <cmath>
+#include <xmmintrin.h>
+
+namespace end
+{
+	void flat_bvh_t::flatten(const bvh_t& source, uint32_t max_leaf_size)
+	{
+		nodes.clear();
+		leaf_blocks.clear();
+		nodes.reserve(source.node_count());
+
+		if (source.node_count() == 0)
+			return;
+
+		// Number of elements under each source node.
+		// Children are always stored after their parent, so a backwards sweep is enough.
+		std::vector<uint32_t> element_counts(source.node_count());
+		for (size_t i = source.node_count(); i-- > 0;)
+		{
+			const bvh_node_t& node = source.bvh[i];
+			element_counts[i] = node.is_leaf() ? 1 : element_counts[node.left()] + element_counts[node.right()];
+		}
+
+		// Pairs of (source index, flat index of the parent waiting for its right child)
+		struct pending_t
+		{
+			uint32_t source_index;
+			uint32_t parent;
+		};
+
+		std::vector<pending_t> pending;
+		pending.push_back({ 0, UINT32_MAX });
+
+		// Source leaves of the subtree being collapsed
+		std::vector<uint32_t> subtree;
+
+		while (!pending.empty())
+		{
+			pending_t next = pending.back();
+			pending.pop_back();
+
+			uint32_t index = (uint32_t)nodes.size();
+			if (next.parent != UINT32_MAX)
+				nodes[next.parent].offset = index;
+
+			const bvh_node_t& node = source.bvh[next.source_index];
+			const aabb_t& aabb = node.aabb();
+
+			flat_bvh_node_t flat_node;
+			flat_node.min = aabb.center - aabb.extents;
+			flat_node.max = aabb.center + aabb.extents;
+
+			if (node.is_leaf())
+			{
+				flat_node.offset = node.element_id();
+				flat_node.count = 1;
+				nodes.push_back(flat_node);
+				continue;
+			}
+
+			if (element_counts[next.source_index] <= max_leaf_size)
+			{
+				// Gather the subtree's leaves and pack their boxes into blocks
+				subtree.clear();
+				subtree.push_back(next.source_index);
+				for (size_t i = 0; i < subtree.size();)
+				{
+					const bvh_node_t& child = source.bvh[subtree[i]];
+					if (child.is_leaf())
+					{
+						i++;
+						continue;
+					}
+
+					subtree[i] = child.left();
+					subtree.push_back(child.right());
+				}
+
+				flat_node.offset = (uint32_t)leaf_blocks.size();
+				flat_node.count = (uint32_t)subtree.size();
+				nodes.push_back(flat_node);
+
+				uint32_t block_count = (flat_node.count + FLAT_BVH_BLOCK_SIZE - 1) / FLAT_BVH_BLOCK_SIZE;
+				for (uint32_t b = 0; b < block_count; b++)
+				{
+					flat_bvh_leaf_block_t block;
+					for (uint32_t i = 0; i < FLAT_BVH_BLOCK_SIZE; i++)
+					{
+						uint32_t slot = b * FLAT_BVH_BLOCK_SIZE + i;
+						if (slot >= flat_node.count)
+						{
+							block.min_x[i] = block.min_y[i] = block.min_z[i] = INFINITY;
+							block.max_x[i] = block.max_y[i] = block.max_z[i] = -INFINITY;
+							block.element_ids[i] = UINT32_MAX;
+							continue;
+						}
+
+						const bvh_node_t& leaf = source.bvh[subtree[slot]];
+						float3 leaf_min = leaf.aabb().center - leaf.aabb().extents;
+						float3 leaf_max = leaf.aabb().center + leaf.aabb().extents;
+
+						block.min_x[i] = leaf_min.x; block.min_y[i] = leaf_min.y; block.min_z[i] = leaf_min.z;
+						block.max_x[i] = leaf_max.x; block.max_y[i] = leaf_max.y; block.max_z[i] = leaf_max.z;
+						block.element_ids[i] = leaf.element_id();
+					}
+
+					leaf_blocks.push_back(block);
+				}
+
+				continue;
+			}
+
+			flat_node.offset = 0;
+			flat_node.count = 0;
+			nodes.push_back(flat_node);
+
+			// Left is popped first, so it lands right after its parent
+			pending.push_back({ node.right(), index });
+			pending.push_back({ node.left(), UINT32_MAX });
+		}
+	}
+
+	void flat_bvh_t::query(const aabb_t& target, std::vector<int>& out)const
+	{
+		if (nodes.empty())
+			return;
+
+		const float3 target_min = target.center - target.extents;
+		const float3 target_max = target.center + target.extents;
+
+		const __m128 min_x = _mm_set1_ps(target_min.x);
+		const __m128 min_y = _mm_set1_ps(target_min.y);
+		const __m128 min_z = _mm_set1_ps(target_min.z);
+		const __m128 max_x = _mm_set1_ps(target_max.x);
+		const __m128 max_y = _mm_set1_ps(target_max.y);
+		const __m128 max_z = _mm_set1_ps(target_max.z);
+
+		bvh_stack_t<uint32_t> stack;
+		uint32_t index = 0;
+
+		while (true)
+		{
+			const flat_bvh_node_t& node = nodes[index];
+
+			bool collides =
+				node.min.x < target_max.x && node.max.x > target_min.x &&
+				node.min.y < target_max.y && node.max.y > target_min.y &&
+				node.min.z < target_max.z && node.max.z > target_min.z;
+
+			if (collides)
+			{
+				if (!node.is_leaf())
+				{
+					stack.push(node.offset);
+					index++;
+					continue;
+				}
+
+				if (node.count == 1)
+				{
+					out.push_back(node.offset);
+				}
+				else
+				{
+					const flat_bvh_leaf_block_t* block = leaf_blocks.data() + node.offset;
+					const flat_bvh_leaf_block_t* blocks_end = block + (node.count + FLAT_BVH_BLOCK_SIZE - 1) / FLAT_BVH_BLOCK_SIZE;
+
+					for (; block < blocks_end; block++)
+					{
+						__m128 hit = _mm_and_ps(
+							_mm_and_ps(
+								_mm_cmplt_ps(_mm_loadu_ps(block->min_x), max_x),
+								_mm_cmpgt_ps(_mm_loadu_ps(block->max_x), min_x)),
+							_mm_and_ps(
+								_mm_and_ps(
+									_mm_cmplt_ps(_mm_loadu_ps(block->min_y), max_y),
+									_mm_cmpgt_ps(_mm_loadu_ps(block->max_y), min_y)),
+								_mm_and_ps(
+									_mm_cmplt_ps(_mm_loadu_ps(block->min_z), max_z),
+									_mm_cmpgt_ps(_mm_loadu_ps(block->max_z), min_z))));
+
+						int mask = _mm_movemask_ps(hit);
+						for (uint32_t i = 0; mask; i++, mask >>= 1)
+						{
+							if (mask & 1)
+								out.push_back(block->element_ids[i]);
+						}
+					}
+				}
+			}
+
+			if (stack.empty())
+				break;
+
+			index = stack.pop();
+		}
+	}
+}
\ No newline at end of file
@@ -0,0 +1,81 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+#include "math_types.h"
+#include "bvh.h"
+#include "aligned_allocator.h"
+
+namespace end
+{
+	// flat_bvh_node_t
+	//
+	// 32-byte node of a flat_bvh_t.
+	// flat_bvh_t keeps them in 64-byte aligned storage, so two fill a cache line and none straddle one.
+	// Nodes are stored depth-first, so a branch's left child is always the next node
+	// and only the right child's index needs to be stored.
+	struct flat_bvh_node_t
+	{
+		float3 min;
+
+		// Branches: index of the right child
+		// Leaves with one element: element id
+		// Leaves with more elements: index of their first flat_bvh_leaf_block_t
+		uint32_t offset;
+
+		float3 max;
+
+		// 0 for branches, number of elements for leaves
+		uint32_t count;
+
+		inline bool is_leaf()const { return count != 0; }
+	};
+
+	static_assert(sizeof(flat_bvh_node_t) == 32, "flat_bvh_node_t must stay 32 bytes");
+
+	// Elements per flat_bvh_leaf_block_t, one SSE register wide
+	constexpr uint32_t FLAT_BVH_BLOCK_SIZE = 4;
+
+	// flat_bvh_leaf_block_t
+	//
+	// Boxes of up to four elements of a leaf, as min/max SoA so they're tested together.
+	// A leaf's blocks are contiguous, and unused slots have boxes that never collide.
+	// std::vector doesn't guarantee 16-byte alignment here, so the boxes are read with unaligned loads.
+	struct flat_bvh_leaf_block_t
+	{
+		float min_x[FLAT_BVH_BLOCK_SIZE];
+		float min_y[FLAT_BVH_BLOCK_SIZE];
+		float min_z[FLAT_BVH_BLOCK_SIZE];
+		float max_x[FLAT_BVH_BLOCK_SIZE];
+		float max_y[FLAT_BVH_BLOCK_SIZE];
+		float max_z[FLAT_BVH_BLOCK_SIZE];
+		uint32_t element_ids[FLAT_BVH_BLOCK_SIZE];
+	};
+
+	// flat_bvh_t
+	//
+	// Read-only, cache-friendly copy of a bvh_t for fast queries.
+	// Rebuild it with flatten() whenever the source bvh changes.
+	class flat_bvh_t
+	{
+	public:
+		// Replaces this tree with a depth-first copy of 'source'.
+		// Subtrees with up to 'max_leaf_size' elements are collapsed into a single leaf,
+		// whose element boxes are stored in leaf blocks and tested four at a time.
+		void flatten(const bvh_t& source, uint32_t max_leaf_size = 1);
+
+		inline size_t node_count()const { return nodes.size(); }
+
+		inline const flat_bvh_node_t* data()const { return nodes.data(); }
+
+		inline size_t leaf_block_count()const { return leaf_blocks.size(); }
+
+		// Adds the element id of every leaf that collides with 'target' to 'out'.
+		// Returns the same elements as bvh_t::traverse_tree, without any debug drawing.
+		void query(const aabb_t& target, std::vector<int>& out)const;
+
+	private:
+		std::vector<flat_bvh_node_t, aligned_allocator_t<flat_bvh_node_t, 64>> nodes;
+		std::vector<flat_bvh_leaf_block_t> leaf_blocks;
+	};
+}
\ No newline at end of file
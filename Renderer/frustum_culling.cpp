@@ -1,6 +1,9 @@
 #include "frustum_culling.h"
 #include "MatrixMath.h"
 #include <cmath>        // std::abs
+#include <algorithm>
+#include <xmmintrin.h>
+#include "parallel.h"
 
 using namespace end;
 
@@ -85,6 +88,66 @@ void end::calculate_frustum(camera_properties& cam_props, frustum_t& frustum, co
 	frustum[5] = calculate_plane(points.NBL, points.FBL, points.FBR);
 }
 
+namespace
+{
+	// Turns the clip space plane dot(clip, coefficients) >= 0 into a normalized world space plane.
+	//
+	// 'coefficients' is a combination of projection matrix columns, so it is a plane in view space.
+	// The view matrix is orthonormal, so moving it to world space only needs the camera's axes and position.
+	plane_t make_world_plane(const float4& coefficients, const view_t& view)
+	{
+		const float4x4_a& m = view.view_mat;
+		float3 axis_x = { m[0].x, m[0].y, m[0].z };
+		float3 axis_y = { m[1].x, m[1].y, m[1].z };
+		float3 axis_z = { m[2].x, m[2].y, m[2].z };
+		float3 position = { m[3].x, m[3].y, m[3].z };
+
+		float3 normal = axis_x * coefficients.x + axis_y * coefficients.y + axis_z * coefficients.z;
+		float d = coefficients.w - normal.dot(normal, position);
+
+		float inv_length = 1.0f / std::sqrt(normal.dot(normal, normal));
+
+		plane_t plane;
+		plane.normal = normal * inv_length;
+		plane.offset = -d * inv_length;
+		return plane;
+	}
+
+	// Returns w_scale * column 3 + sign * column 'index' of a row-vector projection matrix.
+	// Clip space points with dot(clip, result) >= 0 are on the inside of that plane.
+	float4 clip_plane(const float4x4_a& proj, int index, float sign, float w_scale)
+	{
+		float4 result;
+		for (int row = 0; row < 4; row++)
+			result[row] = w_scale * proj[row][3] + sign * proj[row][index];
+		return result;
+	}
+}
+
+void end::calculate_frustum(const view_t& view, frustum_t& frustum)
+{
+	const float4x4_a& proj = view.proj_mat;
+
+	// Left Plane: -w <= x
+	frustum[0] = make_world_plane(clip_plane(proj, 0, 1.0f, 1.0f), view);
+	// Right Plane: x <= w
+	frustum[1] = make_world_plane(clip_plane(proj, 0, -1.0f, 1.0f), view);
+	// Far Plane: z <= w
+	frustum[2] = make_world_plane(clip_plane(proj, 2, -1.0f, 1.0f), view);
+	// Near Plane: 0 <= z
+	frustum[3] = make_world_plane(clip_plane(proj, 2, 1.0f, 0.0f), view);
+	// Top Plane: y <= w
+	frustum[4] = make_world_plane(clip_plane(proj, 1, -1.0f, 1.0f), view);
+	// Bottom Plane: -w <= y
+	frustum[5] = make_world_plane(clip_plane(proj, 1, 1.0f, 1.0f), view);
+}
+
+void end::calculate_frustums(const view_t* views, frustum_t* frustums, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+		calculate_frustum(views[i], frustums[i]);
+}
+
 int end::classify_sphere_to_plane(const sphere_t& sphere, const plane_t& plane)
 {
 	float3 center = sphere.center;
@@ -124,3 +187,271 @@ bool end::aabb_to_frustum(const aabb_t& aabb, const frustum_t& frustum)
 
 
 
+
+
+void end::aabb_soa_t::push_back(const aabb_t& aabb)
+{
+	center_x.push_back(aabb.center.x);
+	center_y.push_back(aabb.center.y);
+	center_z.push_back(aabb.center.z);
+	extents_x.push_back(aabb.extents.x);
+	extents_y.push_back(aabb.extents.y);
+	extents_z.push_back(aabb.extents.z);
+}
+
+void end::aabb_soa_t::clear()
+{
+	center_x.clear();
+	center_y.clear();
+	center_z.clear();
+	extents_x.clear();
+	extents_y.clear();
+	extents_z.clear();
+}
+
+namespace
+{
+	// Calls emit(first, mask) for every group of up to four aabbs in [begin, end) starting at 'first',
+	// with bit i of the mask set if aabb (first + i) is visible
+	template<typename Emit>
+	void cull_aabb_groups(const aabb_soa_t& aabbs, size_t begin, size_t end, const frustum_t& frustum, Emit&& emit)
+	{
+		// Plane normals, their absolute values and offsets, splatted across all four lanes
+		__m128 normal_x[6], normal_y[6], normal_z[6];
+		__m128 abs_x[6], abs_y[6], abs_z[6];
+		__m128 offset[6];
+		for (int i = 0; i < 6; i++)
+		{
+			const plane_t& plane = frustum[i];
+			normal_x[i] = _mm_set1_ps(plane.normal.x);
+			normal_y[i] = _mm_set1_ps(plane.normal.y);
+			normal_z[i] = _mm_set1_ps(plane.normal.z);
+			abs_x[i] = _mm_set1_ps(std::abs(plane.normal.x));
+			abs_y[i] = _mm_set1_ps(std::abs(plane.normal.y));
+			abs_z[i] = _mm_set1_ps(std::abs(plane.normal.z));
+			offset[i] = _mm_set1_ps(plane.offset);
+		}
+
+		const __m128 zero = _mm_setzero_ps();
+		const size_t group_end = begin + ((end - begin) & ~(size_t)3);
+
+		for (size_t first = begin; first < group_end; first += 4)
+		{
+			__m128 center_x = _mm_loadu_ps(aabbs.center_x.data() + first);
+			__m128 center_y = _mm_loadu_ps(aabbs.center_y.data() + first);
+			__m128 center_z = _mm_loadu_ps(aabbs.center_z.data() + first);
+			__m128 extents_x = _mm_loadu_ps(aabbs.extents_x.data() + first);
+			__m128 extents_y = _mm_loadu_ps(aabbs.extents_y.data() + first);
+			__m128 extents_z = _mm_loadu_ps(aabbs.extents_z.data() + first);
+
+			// Same math as classify_aabb_to_plane, culled once behind any plane
+			__m128 culled = zero;
+			for (int i = 0; i < 6; i++)
+			{
+				__m128 dist = _mm_sub_ps(
+					_mm_add_ps(_mm_add_ps(_mm_mul_ps(center_x, normal_x[i]), _mm_mul_ps(center_y, normal_y[i])), _mm_mul_ps(center_z, normal_z[i])),
+					offset[i]);
+				__m128 radius = _mm_add_ps(_mm_add_ps(_mm_mul_ps(extents_x, abs_x[i]), _mm_mul_ps(extents_y, abs_y[i])), _mm_mul_ps(extents_z, abs_z[i]));
+
+				culled = _mm_or_ps(culled, _mm_cmplt_ps(dist, _mm_sub_ps(zero, radius)));
+			}
+
+			emit(first, (uint32_t)(~_mm_movemask_ps(culled) & 0xF));
+		}
+
+		// Leftovers go through the scalar path
+		if (group_end < end)
+		{
+			uint32_t mask = 0;
+			for (size_t i = group_end; i < end; i++)
+			{
+				aabb_t aabb = {
+					float3(aabbs.center_x[i], aabbs.center_y[i], aabbs.center_z[i]),
+					float3(aabbs.extents_x[i], aabbs.extents_y[i], aabbs.extents_z[i])
+				};
+
+				if (aabb_to_frustum(aabb, frustum))
+					mask |= 1u << (i - group_end);
+			}
+
+			emit(group_end, mask);
+		}
+	}
+}
+
+void end::aabbs_to_frustum(const aabb_soa_t& aabbs, const frustum_t& frustum, std::vector<uint32_t>& visible_mask)
+{
+	visible_mask.assign((aabbs.size() + 31) / 32, 0);
+
+	cull_aabb_groups(aabbs, 0, aabbs.size(), frustum, [&](size_t first, uint32_t mask)
+	{
+		visible_mask[first / 32] |= mask << (first % 32);
+	});
+}
+
+void end::aabbs_to_frustum_indices(const aabb_soa_t& aabbs, const frustum_t& frustum, std::vector<uint32_t>& visible_indices)
+{
+	visible_indices.clear();
+
+	cull_aabb_groups(aabbs, 0, aabbs.size(), frustum, [&](size_t first, uint32_t mask)
+	{
+		for (uint32_t i = 0; mask; i++, mask >>= 1)
+		{
+			if (mask & 1)
+				visible_indices.push_back((uint32_t)(first + i));
+		}
+	});
+}
+
+void end::cull_view(view_t& view, const frustum_t& frustum, const aabb_soa_t& aabbs, uint32_t thread_count)
+{
+	const uint32_t chunk_count = (uint32_t)((aabbs.size() + CULL_CHUNK_SIZE - 1) / CULL_CHUNK_SIZE);
+
+	// One output list per chunk, so workers never share anything they write to.
+	// Reused between calls; workers reach it through a reference, since naming a thread_local
+	// inside the lambda would give each worker its own copy.
+	thread_local std::vector<std::vector<uint32_t>> chunk_scratch;
+	thread_local std::vector<size_t> chunk_offsets;
+	if (chunk_scratch.size() < chunk_count)
+		chunk_scratch.resize(chunk_count);
+	std::vector<std::vector<uint32_t>>& chunk_visible = chunk_scratch;
+
+	parallel_for(chunk_count, [&](uint32_t chunk)
+	{
+		size_t start = (size_t)chunk * CULL_CHUNK_SIZE;
+		size_t stop = std::min(start + CULL_CHUNK_SIZE, aabbs.size());
+
+		std::vector<uint32_t>& out = chunk_visible[chunk];
+		out.clear();
+		cull_aabb_groups(aabbs, start, stop, frustum, [&](size_t first, uint32_t mask)
+		{
+			for (uint32_t i = 0; mask; i++, mask >>= 1)
+			{
+				if (mask & 1)
+					out.push_back((uint32_t)(first + i));
+			}
+		});
+	}, thread_count);
+
+	// Prefix sum of the chunk sizes gives each chunk its spot in the visible set.
+	// The merge is only a copy, so it's cheaper on this thread than as a second job.
+	chunk_offsets.resize(chunk_count + 1);
+	chunk_offsets[0] = 0;
+	for (uint32_t chunk = 0; chunk < chunk_count; chunk++)
+		chunk_offsets[chunk + 1] = chunk_offsets[chunk] + chunk_visible[chunk].size();
+
+	view.visible_set.resize(chunk_offsets[chunk_count]);
+
+	for (uint32_t chunk = 0; chunk < chunk_count; chunk++)
+	{
+		const std::vector<uint32_t>& out = chunk_visible[chunk];
+		std::copy(out.begin(), out.end(), view.visible_set.begin() + chunk_offsets[chunk]);
+	}
+}
+
+void end::frustum_cull_cache_t::reset()
+{
+	last_aabbs.clear();
+	margins.clear();
+	last_planes.clear();
+	last_visible.clear();
+}
+
+void end::aabbs_to_frustum_coherent(const aabb_t* aabbs, size_t count, const frustum_t& frustum, frustum_cull_cache_t& cache,
+	std::vector<uint32_t>& visible_indices, frustum_cull_stats_t* stats)
+{
+	visible_indices.clear();
+
+	if (cache.margins.size() != count)
+	{
+		cache.last_aabbs.assign(aabbs, aabbs + count);
+		cache.margins.assign(count, 0.0f);
+		cache.last_planes.assign(count, 0);
+		cache.last_visible.assign(count, 0);
+		cache.last_frustum = frustum;
+	}
+
+	// A plane whose normal moved by 'normal_motion' and offset by 'offset_motion' moves the distance
+	// of a point p by at most normal_motion * |p| + offset_motion
+	float normal_motion = 0.0f;
+	float offset_motion = 0.0f;
+	for (int i = 0; i < 6; i++)
+	{
+		float3 delta = frustum[i].normal - cache.last_frustum[i].normal;
+		normal_motion = std::max(normal_motion, std::sqrt(delta.dot(delta, delta)));
+		offset_motion = std::max(offset_motion, std::abs(frustum[i].offset - cache.last_frustum[i].offset));
+	}
+	cache.last_frustum = frustum;
+
+	uint32_t plane_tests = 0;
+	uint32_t objects_tested = 0;
+
+	for (size_t i = 0; i < count; i++)
+	{
+		const aabb_t& aabb = aabbs[i];
+		aabb_t& last = cache.last_aabbs[i];
+
+		if (cache.margins[i] > 0.0f)
+		{
+			// Bounds how much dist - radius and dist + radius changed on any plane
+			float3 center_delta = aabb.center - last.center;
+			float3 extents_delta = aabb.extents - last.extents;
+			float motion = std::sqrt(center_delta.dot(center_delta, center_delta))
+				+ std::sqrt(extents_delta.dot(extents_delta, extents_delta))
+				+ normal_motion * (std::sqrt(last.center.dot(last.center, last.center)) + std::sqrt(last.extents.dot(last.extents, last.extents)))
+				+ offset_motion;
+
+			// The motion is used up from the margin, so small moves can't add up past it
+			if (motion < cache.margins[i])
+			{
+				cache.margins[i] -= motion;
+				last = aabb;
+
+				if (cache.last_visible[i])
+					visible_indices.push_back((uint32_t)i);
+				continue;
+			}
+		}
+
+		objects_tested++;
+		last = aabb;
+
+		// Same test as classify_aabb_to_plane, keeping how far the result is from flipping
+		bool visible = true;
+		float margin = INFINITY;
+		int first_plane = cache.last_planes[i];
+		for (int k = 0; k < 6; k++)
+		{
+			int plane_index = (first_plane + k) % 6;
+			const plane_t& plane = frustum[plane_index];
+
+			float3 normal_abs = { std::abs(plane.normal.x), std::abs(plane.normal.y), std::abs(plane.normal.z) };
+			float radius = normal_abs.dot(aabb.extents, normal_abs);
+			float dist = normal_abs.dot(aabb.center, plane.normal) - plane.offset;
+			plane_tests++;
+
+			if (dist < -radius)
+			{
+				visible = false;
+				margin = -radius - dist;
+				cache.last_planes[i] = (uint8_t)plane_index;
+				break;
+			}
+
+			// Visible objects keep their result while they're fully inside every plane
+			margin = std::min(margin, dist - radius);
+		}
+
+		cache.margins[i] = margin;
+		cache.last_visible[i] = visible;
+		if (visible)
+			visible_indices.push_back((uint32_t)i);
+	}
+
+	if (stats)
+	{
+		stats->plane_tests = plane_tests;
+		stats->objects_tested = objects_tested;
+		stats->objects_skipped = (uint32_t)count - objects_tested;
+	}
+}
\ No newline at end of file
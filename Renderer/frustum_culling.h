@@ -1,6 +1,8 @@
 #pragma once
 
 #include <array>
+#include <vector>
+#include <cstdint>
 #include "math_types.h"
 #include "view.h"
 
@@ -63,6 +65,15 @@ namespace end
 	void calculate_frustum(camera_properties& cam_props, frustum_t& frustum, 
 		const view_t& view);
 
+	// Extracts the frustum planes straight from the view's view and projection matrices (Gribb/Hartmann).
+	//
+	// view_mat is the camera's world matrix, proj_mat a D3D style projection (clip z from 0 to w).
+	// Planes come out normalized, pointing inward, in the same order as calculate_frustum.
+	void calculate_frustum(const view_t& view, frustum_t& frustum);
+
+	// Same as above, for 'count' views at once
+	void calculate_frustums(const view_t* views, frustum_t* frustums, size_t count);
+
 	// Calculates which side of a plane the sphere is on.
 	//
 	// Returns -1 if the sphere is completely behind the plane.
@@ -83,4 +94,73 @@ namespace end
 	// Returns false if the aabb is completely behind any plane.
 	// Otherwise returns true.
 	bool aabb_to_frustum(const aabb_t& aabb, const frustum_t& frustum);
+
+	// Aabbs stored as one array per component, for culling many at once
+	struct aabb_soa_t
+	{
+		std::vector<float> center_x, center_y, center_z;
+		std::vector<float> extents_x, extents_y, extents_z;
+
+		inline size_t size()const { return center_x.size(); }
+
+		void push_back(const aabb_t& aabb);
+
+		void clear();
+	};
+
+	// Runs aabb_to_frustum on every aabb, four at a time with SSE.
+	//
+	// Sets bit (i % 32) of visible_mask[i / 32] if aabb i is visible, and clears it otherwise.
+	// Gives the same result as aabb_to_frustum for every aabb.
+	void aabbs_to_frustum(const aabb_soa_t& aabbs, const frustum_t& frustum, std::vector<uint32_t>& visible_mask);
+
+	// Same as above, but replaces 'visible_indices' with the indices of the visible aabbs, in order
+	void aabbs_to_frustum_indices(const aabb_soa_t& aabbs, const frustum_t& frustum, std::vector<uint32_t>& visible_indices);
+
+	// Number of aabbs a cull_view worker takes at a time
+	constexpr uint32_t CULL_CHUNK_SIZE = 1024;
+
+	// Replaces view.visible_set with the indices of the aabbs inside 'frustum', in order.
+	//
+	// The aabbs are split into CULL_CHUNK_SIZE chunks culled across up to 'thread_count' threads,
+	// each into its own list, then merged at offsets from a prefix sum of the list sizes.
+	// Chunks run on the shared worker pool, a thread_count of 0 uses all of it.
+	void cull_view(view_t& view, const frustum_t& frustum, const aabb_soa_t& aabbs, uint32_t thread_count = 0);
+
+	// Per object state kept between calls to aabbs_to_frustum_coherent
+	struct frustum_cull_cache_t
+	{
+		frustum_t last_frustum;
+
+		// Bounds each object had when its result was last confirmed
+		std::vector<aabb_t> last_aabbs;
+
+		// How far the bounds or planes can still move before the last result could change.
+		// 0 or less means the next call tests the object again.
+		std::vector<float> margins;
+
+		// Plane that last rejected each object, tested first next time
+		std::vector<uint8_t> last_planes;
+
+		std::vector<uint8_t> last_visible;
+
+		// Forgets everything, so the next call tests every object
+		void reset();
+	};
+
+	struct frustum_cull_stats_t
+	{
+		uint32_t plane_tests = 0;
+		uint32_t objects_tested = 0;
+		uint32_t objects_skipped = 0;
+	};
+
+	// Replaces 'visible_indices' with the indices of the aabbs inside 'frustum', like aabb_to_frustum.
+	//
+	// Objects start with the plane that rejected them last time, which usually rejects them again.
+	// Objects that moved less than the margin their last result had, counting the frustum's movement too,
+	// keep that result without any plane tests.
+	// The cache is reset whenever 'count' changes.
+	void aabbs_to_frustum_coherent(const aabb_t* aabbs, size_t count, const frustum_t& frustum, frustum_cull_cache_t& cache,
+		std::vector<uint32_t>& visible_indices, frustum_cull_stats_t* stats = nullptr);
 }
\ No newline at end of file
@@ -0,0 +1,308 @@
+#include "occlusion_culling.h"
+#include <algorithm>
+#include <cmath>
+#include <xmmintrin.h>
+
+using namespace end;
+
+namespace
+{
+	const uint32_t TILES_X = OCCLUSION_WIDTH / OCCLUSION_TILE_SIZE;
+	const uint32_t TILE_PIXELS = OCCLUSION_TILE_SIZE * OCCLUSION_TILE_SIZE;
+
+	// Levels above the full resolution depth buffer, down to 2x1 texels
+	const uint32_t HIZ_LEVELS = 7;
+
+	// Index of pixel (x, y) in the tiled depth buffer
+	inline size_t pixel_index(uint32_t x, uint32_t y)
+	{
+		uint32_t tile = (y / OCCLUSION_TILE_SIZE) * TILES_X + x / OCCLUSION_TILE_SIZE;
+		return (size_t)tile * TILE_PIXELS + (y % OCCLUSION_TILE_SIZE) * OCCLUSION_TILE_SIZE + x % OCCLUSION_TILE_SIZE;
+	}
+
+	// Projected vertex: x and y in pixels, z the D3D depth
+	struct screen_vertex_t
+	{
+		float x, y, z;
+	};
+
+	// Edge function a->b as A * x + B * y + C, positive on the left of the edge (with y pointing down)
+	struct edge_t
+	{
+		float a, b, c;
+	};
+
+	edge_t make_edge(const screen_vertex_t& from, const screen_vertex_t& to)
+	{
+		edge_t edge;
+		edge.a = -(to.y - from.y);
+		edge.b = to.x - from.x;
+		edge.c = (to.y - from.y) * from.x - (to.x - from.x) * from.y;
+		return edge;
+	}
+}
+
+occlusion_buffer_t::occlusion_buffer_t()
+{
+	depth.assign((size_t)OCCLUSION_WIDTH * OCCLUSION_HEIGHT, 1.0f);
+
+	hiz.resize(HIZ_LEVELS);
+	for (uint32_t level = 1; level <= HIZ_LEVELS; level++)
+		hiz[level - 1].assign((size_t)(OCCLUSION_WIDTH >> level) * (OCCLUSION_HEIGHT >> level), 1.0f);
+
+	for (int i = 0; i < 4; i++)
+		for (int j = 0; j < 4; j++)
+			view_proj[i][j] = i == j ? 1.0f : 0.0f;
+}
+
+void occlusion_buffer_t::begin(const view_t& view)
+{
+	std::fill(depth.begin(), depth.end(), 1.0f);
+
+	// The view matrix is orthonormal, so its inverse is the transposed rotation and a rotated translation
+	const float4x4_a& m = view.view_mat;
+	float inverse_view[4][4];
+	for (int i = 0; i < 3; i++)
+	{
+		for (int j = 0; j < 3; j++)
+			inverse_view[i][j] = m[j][i];
+		inverse_view[i][3] = 0.0f;
+	}
+	for (int j = 0; j < 3; j++)
+		inverse_view[3][j] = -(m[3].x * m[j].x + m[3].y * m[j].y + m[3].z * m[j].z);
+	inverse_view[3][3] = 1.0f;
+
+	for (int i = 0; i < 4; i++)
+	{
+		for (int j = 0; j < 4; j++)
+		{
+			view_proj[i][j] = 0.0f;
+			for (int k = 0; k < 4; k++)
+				view_proj[i][j] += inverse_view[i][k] * view.proj_mat[k][j];
+		}
+	}
+}
+
+void occlusion_buffer_t::rasterize_triangle(const float3& a, const float3& b, const float3& c)
+{
+	const float3* corners[3] = { &a, &b, &c };
+	screen_vertex_t v[3];
+	for (int i = 0; i < 3; i++)
+	{
+		const float3& p = *corners[i];
+		float clip[4];
+		for (int j = 0; j < 4; j++)
+			clip[j] = p.x * view_proj[0][j] + p.y * view_proj[1][j] + p.z * view_proj[2][j] + view_proj[3][j];
+
+		// No near plane clipping, the triangle just doesn't occlude anything
+		if (clip[3] <= 0.0f || clip[2] < 0.0f)
+			return;
+
+		float inv_w = 1.0f / clip[3];
+		v[i].x = (clip[0] * inv_w * 0.5f + 0.5f) * OCCLUSION_WIDTH;
+		v[i].y = (0.5f - clip[1] * inv_w * 0.5f) * OCCLUSION_HEIGHT;
+		v[i].z = clip[2] * inv_w;
+	}
+
+	// Make the winding consistent so the inside is where all edge functions are positive
+	float area = (v[1].x - v[0].x) * (v[2].y - v[0].y) - (v[1].y - v[0].y) * (v[2].x - v[0].x);
+	if (area < 0.0f)
+	{
+		std::swap(v[1], v[2]);
+		area = -area;
+	}
+	if (area < 1e-6f)
+		return;
+
+	// Pixels whose centers fall inside the triangle's bounds
+	float min_x = std::min(v[0].x, std::min(v[1].x, v[2].x));
+	float max_x = std::max(v[0].x, std::max(v[1].x, v[2].x));
+	float min_y = std::min(v[0].y, std::min(v[1].y, v[2].y));
+	float max_y = std::max(v[0].y, std::max(v[1].y, v[2].y));
+	if (max_x < 0.5f || max_y < 0.5f || min_x > OCCLUSION_WIDTH - 0.5f || min_y > OCCLUSION_HEIGHT - 0.5f)
+		return;
+
+	int x0 = std::max(0, (int)std::ceil(min_x - 0.5f));
+	int x1 = std::min((int)OCCLUSION_WIDTH - 1, (int)std::floor(max_x - 0.5f));
+	int y0 = std::max(0, (int)std::ceil(min_y - 0.5f));
+	int y1 = std::min((int)OCCLUSION_HEIGHT - 1, (int)std::floor(max_y - 0.5f));
+	if (x0 > x1 || y0 > y1)
+		return;
+
+	// Each edge weighs the vertex across from it, so depth is a plane in screen space too
+	edge_t e12 = make_edge(v[1], v[2]);
+	edge_t e20 = make_edge(v[2], v[0]);
+	edge_t e01 = make_edge(v[0], v[1]);
+	float inv_area = 1.0f / area;
+	edge_t z_plane;
+	z_plane.a = (v[0].z * e12.a + v[1].z * e20.a + v[2].z * e01.a) * inv_area;
+	z_plane.b = (v[0].z * e12.b + v[1].z * e20.b + v[2].z * e01.b) * inv_area;
+	z_plane.c = (v[0].z * e12.c + v[1].z * e20.c + v[2].z * e01.c) * inv_area;
+
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 lane_offsets = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+	const __m128 a12 = _mm_set1_ps(e12.a), a20 = _mm_set1_ps(e20.a), a01 = _mm_set1_ps(e01.a);
+	const __m128 z_a = _mm_set1_ps(z_plane.a);
+
+	const uint32_t tile_x0 = (uint32_t)x0 / OCCLUSION_TILE_SIZE;
+	const uint32_t tile_x1 = (uint32_t)x1 / OCCLUSION_TILE_SIZE;
+
+	for (int y = y0; y <= y1; y++)
+	{
+		float py = y + 0.5f;
+		__m128 row12 = _mm_set1_ps(e12.b * py + e12.c);
+		__m128 row20 = _mm_set1_ps(e20.b * py + e20.c);
+		__m128 row01 = _mm_set1_ps(e01.b * py + e01.c);
+		__m128 row_z = _mm_set1_ps(z_plane.b * py + z_plane.c);
+
+		for (uint32_t tile_x = tile_x0; tile_x <= tile_x1; tile_x++)
+		{
+			float* row = depth.data() + pixel_index(tile_x * OCCLUSION_TILE_SIZE, (uint32_t)y);
+
+			// Pixels past the bounds are outside the triangle, so whole tile rows can be tested
+			for (uint32_t span = 0; span < OCCLUSION_TILE_SIZE; span += 4)
+			{
+				__m128 px = _mm_add_ps(_mm_set1_ps((float)(tile_x * OCCLUSION_TILE_SIZE + span)), lane_offsets);
+
+				__m128 w12 = _mm_add_ps(_mm_mul_ps(a12, px), row12);
+				__m128 w20 = _mm_add_ps(_mm_mul_ps(a20, px), row20);
+				__m128 w01 = _mm_add_ps(_mm_mul_ps(a01, px), row01);
+				__m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(w12, zero), _mm_cmpge_ps(w20, zero)), _mm_cmpge_ps(w01, zero));
+				if (_mm_movemask_ps(inside) == 0)
+					continue;
+
+				__m128 z = _mm_add_ps(_mm_mul_ps(z_a, px), row_z);
+				__m128 current = _mm_loadu_ps(row + span);
+				__m128 nearest = _mm_min_ps(current, z);
+				_mm_storeu_ps(row + span, _mm_or_ps(_mm_and_ps(inside, nearest), _mm_andnot_ps(inside, current)));
+			}
+		}
+	}
+}
+
+void occlusion_buffer_t::rasterize_quads(const quad_t* quads, const uint32_t* quad_ids, size_t count, const pos_norm_uv_vertex* verts)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		const quad_t& quad = quads[quad_ids[i]];
+		rasterize_triangle(verts[quad.first.a].pos, verts[quad.first.b].pos, verts[quad.first.c].pos);
+		rasterize_triangle(verts[quad.second.a].pos, verts[quad.second.b].pos, verts[quad.second.c].pos);
+	}
+}
+
+void occlusion_buffer_t::build_hiz()
+{
+	// Level 1 reads the tiled depth buffer, the rest read the level below them
+	std::vector<float>& first = hiz[0];
+	uint32_t width = OCCLUSION_WIDTH >> 1;
+	uint32_t height = OCCLUSION_HEIGHT >> 1;
+	for (uint32_t y = 0; y < height; y++)
+	{
+		for (uint32_t x = 0; x < width; x++)
+		{
+			first[y * width + x] = std::max(
+				std::max(depth_at(x * 2, y * 2), depth_at(x * 2 + 1, y * 2)),
+				std::max(depth_at(x * 2, y * 2 + 1), depth_at(x * 2 + 1, y * 2 + 1)));
+		}
+	}
+
+	for (uint32_t level = 2; level <= HIZ_LEVELS; level++)
+	{
+		const std::vector<float>& below = hiz[level - 2];
+		std::vector<float>& current = hiz[level - 1];
+		uint32_t below_width = width;
+		width >>= 1;
+		height >>= 1;
+
+		for (uint32_t y = 0; y < height; y++)
+		{
+			for (uint32_t x = 0; x < width; x++)
+			{
+				const float* top = &below[(y * 2) * below_width + x * 2];
+				const float* bottom = top + below_width;
+				current[y * width + x] = std::max(std::max(top[0], top[1]), std::max(bottom[0], bottom[1]));
+			}
+		}
+	}
+}
+
+float occlusion_buffer_t::depth_at(uint32_t x, uint32_t y)const
+{
+	return depth[pixel_index(x, y)];
+}
+
+float occlusion_buffer_t::max_depth(uint32_t level, uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1)const
+{
+	float result = 0.0f;
+	if (level == 0)
+	{
+		for (uint32_t y = y0; y <= y1; y++)
+			for (uint32_t x = x0; x <= x1; x++)
+				result = std::max(result, depth_at(x, y));
+		return result;
+	}
+
+	const std::vector<float>& texels = hiz[level - 1];
+	uint32_t width = OCCLUSION_WIDTH >> level;
+	for (uint32_t y = y0 >> level; y <= y1 >> level; y++)
+		for (uint32_t x = x0 >> level; x <= x1 >> level; x++)
+			result = std::max(result, texels[y * width + x]);
+	return result;
+}
+
+bool occlusion_buffer_t::aabb_visible(const aabb_t& aabb)const
+{
+	float min_x = INFINITY, min_y = INFINITY, min_z = INFINITY;
+	float max_x = -INFINITY, max_y = -INFINITY;
+
+	for (int corner = 0; corner < 8; corner++)
+	{
+		float3 p = {
+			aabb.center.x + (corner & 1 ? aabb.extents.x : -aabb.extents.x),
+			aabb.center.y + (corner & 2 ? aabb.extents.y : -aabb.extents.y),
+			aabb.center.z + (corner & 4 ? aabb.extents.z : -aabb.extents.z)
+		};
+
+		float clip[4];
+		for (int j = 0; j < 4; j++)
+			clip[j] = p.x * view_proj[0][j] + p.y * view_proj[1][j] + p.z * view_proj[2][j] + view_proj[3][j];
+
+		// Crossing the near plane, the screen rect isn't bounded
+		if (clip[3] <= 0.0f || clip[2] < 0.0f)
+			return true;
+
+		float inv_w = 1.0f / clip[3];
+		float x = (clip[0] * inv_w * 0.5f + 0.5f) * OCCLUSION_WIDTH;
+		float y = (0.5f - clip[1] * inv_w * 0.5f) * OCCLUSION_HEIGHT;
+		min_x = std::min(min_x, x);
+		max_x = std::max(max_x, x);
+		min_y = std::min(min_y, y);
+		max_y = std::max(max_y, y);
+		min_z = std::min(min_z, clip[2] * inv_w);
+	}
+
+	// Off screen aabbs are left to frustum culling
+	if (max_x < 0.0f || max_y < 0.0f || min_x >= OCCLUSION_WIDTH || min_y >= OCCLUSION_HEIGHT)
+		return true;
+
+	// Every pixel the rect touches
+	uint32_t x0 = (uint32_t)std::max(0.0f, std::floor(min_x));
+	uint32_t y0 = (uint32_t)std::max(0.0f, std::floor(min_y));
+	uint32_t x1 = (uint32_t)std::min(OCCLUSION_WIDTH - 1.0f, std::floor(max_x));
+	uint32_t y1 = (uint32_t)std::min(OCCLUSION_HEIGHT - 1.0f, std::floor(max_y));
+
+	// Lowest level where the rect covers at most 2x2 texels
+	uint32_t level = 0;
+	while (level < HIZ_LEVELS && ((x1 >> level) - (x0 >> level) > 1 || (y1 >> level) - (y0 >> level) > 1))
+		level++;
+
+	return min_z <= max_depth(level, x0, y0, x1, y1);
+}
+
+void occlusion_buffer_t::cull_occluded(view_t& view, const aabb_t* aabbs)const
+{
+	std::vector<uint32_t>& visible_set = view.visible_set;
+	visible_set.erase(
+		std::remove_if(visible_set.begin(), visible_set.end(), [&](uint32_t i) { return !aabb_visible(aabbs[i]); }),
+		visible_set.end());
+}
\ No newline at end of file
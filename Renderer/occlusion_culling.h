@@ -0,0 +1,67 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+#include "math_types.h"
+#include "view.h"
+
+namespace end
+{
+	// Size of an occlusion_buffer_t's depth buffer in pixels
+	const uint32_t OCCLUSION_WIDTH = 256;
+	const uint32_t OCCLUSION_HEIGHT = 128;
+
+	// Depth pixels are stored in square tiles of this size, so a tile is only a few cache lines
+	const uint32_t OCCLUSION_TILE_SIZE = 8;
+
+	// occlusion_buffer_t
+	//
+	// Low resolution software depth buffer for occlusion culling without the GPU.
+	//
+	// Occluder triangles are rasterized four pixels at a time with SSE, keeping the nearest depth.
+	// build_hiz() then makes a pyramid of the farthest depth under each texel, and an aabb is
+	// occluded when its nearest depth is farther than every occluder depth over its screen rect.
+	// Depths follow D3D: 0 on the near plane, 1 on the far plane.
+	class occlusion_buffer_t
+	{
+	public:
+		occlusion_buffer_t();
+
+		// Clears the depth buffer to the far plane and takes the view to project with.
+		// view_mat is the camera's world matrix, proj_mat a D3D style projection.
+		void begin(const view_t& view);
+
+		// Rasterizes one occluder triangle.
+		// Triangles crossing the near plane are skipped, which only costs some occlusion.
+		void rasterize_triangle(const float3& a, const float3& b, const float3& c);
+
+		// Rasterizes both triangles of every quad in 'quad_ids'
+		void rasterize_quads(const quad_t* quads, const uint32_t* quad_ids, size_t count, const pos_norm_uv_vertex* verts);
+
+		// Builds the depth pyramid. Call after the occluders are in and before testing aabbs.
+		void build_hiz();
+
+		// Returns false if the aabb is completely hidden behind the occluders.
+		// Aabbs crossing the near plane or leaving the screen are always visible.
+		bool aabb_visible(const aabb_t& aabb)const;
+
+		// Removes the indices of occluded aabbs from view.visible_set, keeping the rest in order
+		void cull_occluded(view_t& view, const aabb_t* aabbs)const;
+
+		// Nearest occluder depth at pixel (x, y)
+		float depth_at(uint32_t x, uint32_t y)const;
+
+	private:
+		// World to clip space, for row vectors
+		float view_proj[4][4];
+
+		// OCCLUSION_TILE_SIZE x OCCLUSION_TILE_SIZE tiles in row-major order, pixels row-major inside each tile
+		std::vector<float> depth;
+
+		// hiz[i] is pyramid level i + 1, (OCCLUSION_WIDTH >> (i + 1)) x (OCCLUSION_HEIGHT >> (i + 1)) row-major
+		std::vector<std::vector<float>> hiz;
+
+		// Max depth of the texels at 'level' covering the pixel rect [x0, x1] x [y0, y1]
+		float max_depth(uint32_t level, uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1)const;
+	};
+}
\ No newline at end of file
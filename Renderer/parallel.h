@@ -0,0 +1,169 @@
+#pragma once
+#include <cstdint>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <algorithm>
+#include <type_traits>
+
+namespace end
+{
+	// Returns the number of threads to use when the caller doesn't ask for a specific count
+	inline uint32_t default_thread_count()
+	{
+		return std::max(1u, std::thread::hardware_concurrency());
+	}
+
+	// worker_pool_t
+	//
+	// Threads that are started once and then sleep until run() hands them a job,
+	// so per-frame work doesn't pay for creating and joining threads.
+	class worker_pool_t
+	{
+	public:
+		// Starts thread_count - 1 workers, the thread calling run() is the last one
+		explicit worker_pool_t(uint32_t thread_count = default_thread_count())
+		{
+			for (uint32_t i = 1; i < thread_count; i++)
+				threads.emplace_back([this]() { worker_loop(); });
+		}
+
+		worker_pool_t(const worker_pool_t&) = delete;
+		worker_pool_t& operator=(const worker_pool_t&) = delete;
+
+		~worker_pool_t()
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				stopping = true;
+			}
+			wake.notify_all();
+
+			for (std::thread& thread : threads)
+				thread.join();
+		}
+
+		inline uint32_t thread_count()const { return (uint32_t)threads.size() + 1; }
+
+		// Calls fn(i) for every i in [0, count) on up to 'max_threads' threads, the calling one included.
+		//
+		// Indices are handed out one at a time, so uneven work balances itself.
+		// Returns once every index is done. Calls made from a worker, or while another thread's
+		// job is running, run serially on the calling thread instead of waiting for the pool.
+		template<typename Fn>
+		void run(uint32_t count, Fn&& fn, uint32_t max_threads)
+		{
+			max_threads = std::min(std::min(max_threads, thread_count()), count);
+
+			std::unique_lock<std::mutex> run_lock(run_mutex, std::try_to_lock);
+			if (max_threads <= 1 || is_worker() || !run_lock.owns_lock())
+			{
+				for (uint32_t i = 0; i < count; i++)
+					fn(i);
+				return;
+			}
+
+			using function_t = typename std::remove_reference<Fn>::type;
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				job_invoke = [](void* context, uint32_t i) { (*(function_t*)context)(i); };
+				job_context = (void*)&fn;
+				job_count = count;
+				next = 0;
+				open_slots = max_threads - 1;
+				active = 0;
+				generation++;
+			}
+			wake.notify_all();
+
+			for (uint32_t i = next++; i < count; i = next++)
+				fn(i);
+
+			// Close the job before returning, so a worker that wakes up late can't join it
+			std::unique_lock<std::mutex> lock(mutex);
+			done.wait(lock, [this]() { return active == 0; });
+			open_slots = 0;
+		}
+
+	private:
+		static bool& is_worker()
+		{
+			thread_local bool worker = false;
+			return worker;
+		}
+
+		void worker_loop()
+		{
+			is_worker() = true;
+
+			uint64_t seen_generation = 0;
+			std::unique_lock<std::mutex> lock(mutex);
+			while (true)
+			{
+				wake.wait(lock, [&]() { return stopping || generation != seen_generation; });
+				if (stopping)
+					return;
+
+				seen_generation = generation;
+				if (open_slots == 0)
+					continue;
+
+				open_slots--;
+				active++;
+				void (*invoke)(void*, uint32_t) = job_invoke;
+				void* context = job_context;
+				uint32_t count = job_count;
+				lock.unlock();
+
+				for (uint32_t i = next++; i < count; i = next++)
+					invoke(context, i);
+
+				lock.lock();
+				if (--active == 0)
+					done.notify_all();
+			}
+		}
+
+		std::vector<std::thread> threads;
+
+		// Only one job runs at a time
+		std::mutex run_mutex;
+
+		// Guards everything below except 'next'
+		std::mutex mutex;
+		std::condition_variable wake;
+		std::condition_variable done;
+		bool stopping = false;
+
+		uint64_t generation = 0;
+		void (*job_invoke)(void*, uint32_t) = nullptr;
+		void* job_context = nullptr;
+		uint32_t job_count = 0;
+		uint32_t open_slots = 0;
+		uint32_t active = 0;
+		std::atomic<uint32_t> next{ 0 };
+	};
+
+	// Pool shared by parallel_for, started on first use with default_thread_count() threads
+	inline worker_pool_t& default_worker_pool()
+	{
+		static worker_pool_t pool;
+		return pool;
+	}
+
+	// Calls fn(i) for every i in [0, count), spread across up to 'thread_count' threads of the default pool.
+	//
+	// Indices are handed out one at a time, so uneven work balances itself.
+	// The calling thread does work too, and the call returns once every index is done.
+	// A thread_count of 0 uses default_thread_count().
+	template<typename Fn>
+	void parallel_for(uint32_t count, Fn&& fn, uint32_t thread_count = 0)
+	{
+		if (thread_count == 0)
+			thread_count = default_thread_count();
+
+		default_worker_pool().run(count, fn, thread_count);
+	}
+}
@@ -0,0 +1,251 @@
+#pragma once
+#include <cstdint>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+#include "math_types.h"
+#include "bvh.h"
+
+namespace end
+{
+	// Set on a child slot that holds an element id instead of a node index
+	constexpr uint32_t QUANTIZED_BVH_LEAF_BIT = 0x80000000u;
+
+	// quantized_bvh_node_t
+	//
+	// Branch of a quantized_bvh_t, holding the boxes of both children as T-sized steps
+	// across its own box. Low corners step up from this node's min, high corners step
+	// down from its max, so the extremes decode exactly and every step rounds outward.
+	// 32 bytes with 16-bit steps, 20 bytes with 8-bit steps.
+	template<typename T>
+	struct quantized_bvh_node_t
+	{
+		T min[2][3];
+		T max[2][3];
+
+		// Node index, or element id | QUANTIZED_BVH_LEAF_BIT
+		uint32_t children[2];
+	};
+
+	// quantized_bvh_t
+	//
+	// Read-only compressed copy of a bvh_t, for worlds too big to keep full float boxes.
+	// Only branches are stored, leaves live in their parent's child slots.
+	// Boxes are decoded on the way down from the float box of the root.
+	// Rebuild it with compress() whenever the source bvh changes.
+	template<typename T>
+	class quantized_bvh_t
+	{
+	public:
+		// Largest step, the size of a node's box along one axis
+		static constexpr uint32_t STEP_COUNT = std::numeric_limits<T>::max();
+
+		// Replaces this tree with a compressed copy of 'source'.
+		// Element ids must fit in 31 bits.
+		void compress(const bvh_t& source);
+
+		inline size_t node_count()const { return nodes.size(); }
+
+		inline const quantized_bvh_node_t<T>* data()const { return nodes.data(); }
+
+		// Adds the element id of every leaf that collides with 'target' to 'out'.
+		// Returns what bvh_t::traverse_tree would, but since boxes are rounded out it can also
+		// return elements that are just outside of 'target'. It never misses one.
+		void query(const aabb_t& target, std::vector<int>& out)const;
+
+	private:
+		// Size of one step across a box, shared by compress() and query() so both decode the same way
+		static inline float step_size(float box_min, float box_max)
+		{
+			return (box_max - box_min) * (1.0f / STEP_COUNT);
+		}
+
+		std::vector<quantized_bvh_node_t<T>> nodes;
+
+		float3 root_min = { 0.0f, 0.0f, 0.0f };
+		float3 root_max = { 0.0f, 0.0f, 0.0f };
+
+		// Element id when the whole tree is a single leaf, UINT32_MAX otherwise
+		uint32_t root_element = UINT32_MAX;
+	};
+
+	using quantized_bvh8_t = quantized_bvh_t<uint8_t>;
+	using quantized_bvh16_t = quantized_bvh_t<uint16_t>;
+
+	template<typename T>
+	void quantized_bvh_t<T>::compress(const bvh_t& source)
+	{
+		nodes.clear();
+		root_element = UINT32_MAX;
+
+		if (source.node_count() == 0)
+			return;
+
+		const bvh_node_t& root = source.bvh[0];
+		root_min = root.aabb().center - root.aabb().extents;
+		root_max = root.aabb().center + root.aabb().extents;
+
+		if (root.is_leaf())
+		{
+			root_element = root.element_id();
+			return;
+		}
+
+		nodes.reserve(source.node_count() / 2);
+
+		// Source branches waiting to be written, along with their decoded box
+		// and the parent's child slot that will point at them
+		struct pending_t
+		{
+			uint32_t source_index;
+			float3 min;
+			float3 max;
+			uint32_t parent;
+			uint32_t slot;
+		};
+
+		std::vector<pending_t> pending;
+		pending.push_back({ 0, root_min, root_max, UINT32_MAX, 0 });
+
+		while (!pending.empty())
+		{
+			pending_t next = pending.back();
+			pending.pop_back();
+
+			uint32_t index = (uint32_t)nodes.size();
+			if (next.parent != UINT32_MAX)
+				nodes[next.parent].children[next.slot] = index;
+
+			nodes.emplace_back();
+
+			const bvh_node_t& node = source.bvh[next.source_index];
+			const uint32_t source_children[2] = { node.left(), node.right() };
+
+			float3 child_min[2];
+			float3 child_max[2];
+
+			for (uint32_t c = 0; c < 2; c++)
+			{
+				const bvh_node_t& child = source.bvh[source_children[c]];
+				float3 exact_min = child.aabb().center - child.aabb().extents;
+				float3 exact_max = child.aabb().center + child.aabb().extents;
+
+				for (int axis = 0; axis < 3; axis++)
+				{
+					float step = step_size(next.min[axis], next.max[axis]);
+
+					// Most steps that keep the decoded min at or below the exact one
+					uint32_t low = 0;
+					if (step > 0.0f)
+						low = (uint32_t)std::min((float)STEP_COUNT, std::max(0.0f, floorf((exact_min[axis] - next.min[axis]) / step)));
+					while (low > 0 && next.min[axis] + low * step > exact_min[axis])
+						low--;
+					while (low < STEP_COUNT && next.min[axis] + (low + 1) * step <= exact_min[axis])
+						low++;
+
+					// Most steps that keep the decoded max at or above the exact one
+					uint32_t high = 0;
+					if (step > 0.0f)
+						high = (uint32_t)std::min((float)STEP_COUNT, std::max(0.0f, floorf((next.max[axis] - exact_max[axis]) / step)));
+					while (high > 0 && next.max[axis] - high * step < exact_max[axis])
+						high--;
+					while (high < STEP_COUNT && next.max[axis] - (high + 1) * step >= exact_max[axis])
+						high++;
+
+					nodes[index].min[c][axis] = (T)low;
+					nodes[index].max[c][axis] = (T)high;
+
+					child_min[c][axis] = next.min[axis] + low * step;
+					child_max[c][axis] = next.max[axis] - high * step;
+				}
+			}
+
+			// Right is pushed first so the left subtree is written next
+			for (uint32_t c = 2; c-- > 0;)
+			{
+				const bvh_node_t& child = source.bvh[source_children[c]];
+				if (child.is_leaf())
+				{
+					nodes[index].children[c] = child.element_id() | QUANTIZED_BVH_LEAF_BIT;
+					continue;
+				}
+
+				pending.push_back({ source_children[c], child_min[c], child_max[c], index, c });
+			}
+		}
+	}
+
+	template<typename T>
+	void quantized_bvh_t<T>::query(const aabb_t& target, std::vector<int>& out)const
+	{
+		const float3 target_min = target.center - target.extents;
+		const float3 target_max = target.center + target.extents;
+
+		auto collides = [&](const float3& box_min, const float3& box_max)
+		{
+			return box_min.x < target_max.x && box_max.x > target_min.x &&
+				box_min.y < target_max.y && box_max.y > target_min.y &&
+				box_min.z < target_max.z && box_max.z > target_min.z;
+		};
+
+		if (!collides(root_min, root_max))
+			return;
+
+		if (root_element != UINT32_MAX)
+		{
+			out.push_back(root_element);
+			return;
+		}
+
+		if (nodes.empty())
+			return;
+
+		// Pending branches, along with their decoded box
+		struct pending_t
+		{
+			uint32_t index;
+			float3 min;
+			float3 max;
+		};
+
+		bvh_stack_t<pending_t> stack;
+		stack.push({ 0, root_min, root_max });
+
+		while (!stack.empty())
+		{
+			pending_t next = stack.pop();
+			const quantized_bvh_node_t<T>& node = nodes[next.index];
+
+			float3 step = {
+				step_size(next.min.x, next.max.x),
+				step_size(next.min.y, next.max.y),
+				step_size(next.min.z, next.max.z)
+			};
+
+			// Right is pushed first so the left child is visited first
+			for (uint32_t c = 2; c-- > 0;)
+			{
+				float3 child_min;
+				float3 child_max;
+				for (int axis = 0; axis < 3; axis++)
+				{
+					child_min[axis] = next.min[axis] + node.min[c][axis] * step[axis];
+					child_max[axis] = next.max[axis] - node.max[c][axis] * step[axis];
+				}
+
+				if (!collides(child_min, child_max))
+					continue;
+
+				uint32_t child = node.children[c];
+				if (child & QUANTIZED_BVH_LEAF_BIT)
+				{
+					out.push_back(child & ~QUANTIZED_BVH_LEAF_BIT);
+					continue;
+				}
+
+				stack.push({ child, child_min, child_max });
+			}
+		}
+	}
+}
\ No newline at end of file
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <cstdint>
+#include <vector>
 #include "math_types.h"
 
 namespace end
@@ -24,7 +26,9 @@ namespace end
 		
 
 
-		// maintains a visible-set of renderable objects in view (implemented in a future assignment)
+		// maintains a visible-set of renderable objects in view:
+		// indices of the objects that passed the last cull_view, in ascending order
+		std::vector<uint32_t> visible_set;
 
 
 		view_t() {}
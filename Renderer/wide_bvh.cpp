@@ -0,0 +1,154 @@
+#include "wide_bvh.h"
+#include <cfloat>
+#include <xmmintrin.h>
+
+namespace end
+{
+	void wide_bvh_t::collapse(const bvh_t& source)
+	{
+		nodes.clear();
+
+		if (source.node_count() == 0)
+			return;
+
+		// Each wide node takes the place of at least one binary branch
+		nodes.reserve(source.node_count() / 2 + 1);
+		collapse_node(source, 0);
+	}
+
+	uint32_t wide_bvh_t::collapse_node(const bvh_t& source, uint32_t source_index)
+	{
+		// Open up the biggest branch until the node is full or only leaves are left
+		uint32_t slots[WIDE_BVH_WIDTH];
+		uint32_t slot_count = 0;
+
+		const bvh_node_t& root = source.bvh[source_index];
+		if (root.is_leaf())
+		{
+			slots[slot_count++] = source_index;
+		}
+		else
+		{
+			slots[slot_count++] = root.left();
+			slots[slot_count++] = root.right();
+		}
+
+		while (slot_count < WIDE_BVH_WIDTH)
+		{
+			uint32_t best_slot = UINT32_MAX;
+			float best_area = -1.0f;
+			for (uint32_t i = 0; i < slot_count; i++)
+			{
+				const bvh_node_t& node = source.bvh[slots[i]];
+				float area = surface_area(node.aabb());
+				if (node.is_branch() && area > best_area)
+				{
+					best_area = area;
+					best_slot = i;
+				}
+			}
+
+			if (best_slot == UINT32_MAX)
+				break;
+
+			const bvh_node_t& opened = source.bvh[slots[best_slot]];
+			slots[best_slot] = opened.left();
+			slots[slot_count++] = opened.right();
+		}
+
+		uint32_t index = (uint32_t)nodes.size();
+		nodes.emplace_back();
+
+		for (uint32_t i = 0; i < WIDE_BVH_WIDTH; i++)
+		{
+			if (i >= slot_count)
+			{
+				wide_bvh_node_t& node = nodes[index];
+				node.min_x[i] = node.min_y[i] = node.min_z[i] = FLT_MAX;
+				node.max_x[i] = node.max_y[i] = node.max_z[i] = -FLT_MAX;
+				node.children[i] = WIDE_BVH_EMPTY;
+				continue;
+			}
+
+			const bvh_node_t& child = source.bvh[slots[i]];
+			uint32_t child_value;
+			if (child.is_leaf())
+			{
+				assert((child.element_id() & WIDE_BVH_LEAF_BIT) == 0);
+				child_value = child.element_id() | WIDE_BVH_LEAF_BIT;
+			}
+			else
+			{
+				// May grow 'nodes', so the parent is only referenced by index
+				child_value = collapse_node(source, slots[i]);
+			}
+
+			const aabb_t& aabb = child.aabb();
+			wide_bvh_node_t& node = nodes[index];
+			node.min_x[i] = aabb.center.x - aabb.extents.x;
+			node.min_y[i] = aabb.center.y - aabb.extents.y;
+			node.min_z[i] = aabb.center.z - aabb.extents.z;
+			node.max_x[i] = aabb.center.x + aabb.extents.x;
+			node.max_y[i] = aabb.center.y + aabb.extents.y;
+			node.max_z[i] = aabb.center.z + aabb.extents.z;
+			node.children[i] = child_value;
+		}
+
+		return index;
+	}
+
+	void wide_bvh_t::query(const aabb_t& target, std::vector<int>& out)const
+	{
+		if (nodes.empty())
+			return;
+
+		const float3 target_min = target.center - target.extents;
+		const float3 target_max = target.center + target.extents;
+		const __m128 min_x = _mm_set1_ps(target_min.x);
+		const __m128 min_y = _mm_set1_ps(target_min.y);
+		const __m128 min_z = _mm_set1_ps(target_min.z);
+		const __m128 max_x = _mm_set1_ps(target_max.x);
+		const __m128 max_y = _mm_set1_ps(target_max.y);
+		const __m128 max_z = _mm_set1_ps(target_max.z);
+
+		bvh_stack_t<uint32_t> stack;
+		stack.push(0);
+
+		while (!stack.empty())
+		{
+			const wide_bvh_node_t& node = nodes[stack.pop()];
+
+			// Same test as aabbs_collide, for all four children at once
+			__m128 hit = _mm_and_ps(
+				_mm_and_ps(
+					_mm_cmplt_ps(_mm_loadu_ps(node.min_x), max_x),
+					_mm_cmpgt_ps(_mm_loadu_ps(node.max_x), min_x)),
+				_mm_and_ps(
+					_mm_and_ps(
+						_mm_cmplt_ps(_mm_loadu_ps(node.min_y), max_y),
+						_mm_cmpgt_ps(_mm_loadu_ps(node.max_y), min_y)),
+					_mm_and_ps(
+						_mm_cmplt_ps(_mm_loadu_ps(node.min_z), max_z),
+						_mm_cmpgt_ps(_mm_loadu_ps(node.max_z), min_z))));
+
+			int mask = _mm_movemask_ps(hit);
+
+			// Push in reverse so children come off the stack in slot order
+			for (int i = WIDE_BVH_WIDTH - 1; i >= 0; i--)
+			{
+				if ((mask & (1 << i)) == 0)
+					continue;
+
+				uint32_t child = node.children[i];
+				if (child & WIDE_BVH_LEAF_BIT)
+				{
+					out.push_back(child & ~WIDE_BVH_LEAF_BIT);
+				}
+				else
+				{
+					stack.push(child);
+				}
+			}
+		}
+	}
+}
\ No newline at end of file
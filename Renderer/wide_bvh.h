@@ -0,0 +1,63 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+#include "math_types.h"
+#include "bvh.h"
+
+namespace end
+{
+	// Number of children per wide_bvh_node_t, one per SSE lane
+	constexpr uint32_t WIDE_BVH_WIDTH = 4;
+
+	// Set on a child slot that holds an element id instead of a node index
+	constexpr uint32_t WIDE_BVH_LEAF_BIT = 0x80000000u;
+
+	// Value of an unused child slot
+	constexpr uint32_t WIDE_BVH_EMPTY = 0xFFFFFFFFu;
+
+	// wide_bvh_node_t
+	//
+	// Node of a 4-wide bvh (BVH4).
+	// Child bounds are stored as structure-of-arrays so all four can be tested with one
+	// set of SSE instructions. Unused slots get inverted bounds and never collide.
+	// std::vector doesn't guarantee 16-byte alignment here, so the bounds are read with unaligned loads.
+	struct wide_bvh_node_t
+	{
+		float min_x[WIDE_BVH_WIDTH];
+		float min_y[WIDE_BVH_WIDTH];
+		float min_z[WIDE_BVH_WIDTH];
+		float max_x[WIDE_BVH_WIDTH];
+		float max_y[WIDE_BVH_WIDTH];
+		float max_z[WIDE_BVH_WIDTH];
+
+		// Node index, element id | WIDE_BVH_LEAF_BIT, or WIDE_BVH_EMPTY
+		uint32_t children[WIDE_BVH_WIDTH];
+	};
+
+	// wide_bvh_t
+	//
+	// Read-only 4-wide copy of a bvh_t.
+	// Every wide node replaces up to three binary branches, so queries visit far fewer nodes.
+	// Rebuild it with collapse() whenever the source bvh changes.
+	class wide_bvh_t
+	{
+	public:
+		// Replaces this tree with a collapsed copy of 'source'.
+		// Element ids must fit in 31 bits.
+		void collapse(const bvh_t& source);
+
+		inline size_t node_count()const { return nodes.size(); }
+
+		inline const wide_bvh_node_t* data()const { return nodes.data(); }
+
+		// Adds the element id of every leaf that collides with 'target' to 'out'.
+		// Returns the same elements as bvh_t::traverse_tree, without any debug drawing.
+		void query(const aabb_t& target, std::vector<int>& out)const;
+
+	private:
+		uint32_t collapse_node(const bvh_t& source, uint32_t source_index);
+
+		std::vector<wide_bvh_node_t> nodes;
+	};
+}
\ No newline at end of file